@@ -0,0 +1,355 @@
+/* bench.c - microbenchmarks of the daemon's hot paths
+ *
+ * This file is part of preload.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+/* Times one case of the daemon's hot paths at each of the sizes given,
+ * and prints a JSON object per size on stdout, for scripts to compare
+ * across commits.  Models are synthetic and seeded, so that runs are
+ * comparable, unless a state file, such as one made by preload-gen, is
+ * given instead.  Likewise, the proc cases can read a fake procfs made
+ * by preload-gen, for scan throughput at any number of processes.
+ * ns_per_op is the mean over all the repeats,
+ * min_ns_per_op the best repeat. */
+
+#include <getopt.h>
+#include <glib/gstdio.h>
+#include <time.h>
+
+#include "common.h"
+#include "conf.h"
+#include "log.h"
+#include "proc.h"
+#include "prophet.h"
+#include "readahead.h"
+#include "state.h"
+#include "synth.h"
+
+typedef struct _bench_t {
+    const char* name;
+    const char* sizes; /* default sizes, comma separated */
+    const char* unit;  /* of the size */
+    void (*setup)(int size);
+    void (*run)(int size);
+    void (*teardown)(void);
+} bench_t;
+
+static int repeats = 5;
+static double mintime = 0.2; /* seconds per repeat, at least */
+
+static const char* modelfile; /* instead of synthetic models */
+static double density = 100;    /* of the synthetic models */
+static char* statefile;
+static pid_t maps_pid; /* of the maps case */
+static GPtrArray* files; /* of the readahead cases */
+static char* filesdir;   /* where they live */
+static int nfiles;
+
+/* building a model */
+
+static void model_setup(int size) {
+    synth_params_t params = SYNTH_PARAMS_DEFAULT;
+
+    if (modelfile) {
+        preload_state_load(modelfile);
+        return;
+    }
+
+    params.exes = size;
+    params.density = density;
+    preload_state_load(NULL);
+    synth_model(&params);
+}
+
+static void model_teardown(void) {
+    preload_state_free();
+}
+
+/* the cases */
+
+static void count_process(pid_t G_GNUC_UNUSED pid,
+                          const char G_GNUC_UNUSED* path,
+                          int* count) {
+    (*count)++;
+}
+
+static void last_process(pid_t pid, const char G_GNUC_UNUSED* path,
+                         pid_t* last) {
+    *last = pid;
+}
+
+/* our own maps, unless reading another procfs */
+static void maps_setup(int G_GNUC_UNUSED size) {
+    maps_pid = getpid();
+    if (strcmp(proc_get_root(), DEFAULT_PROCROOT))
+        proc_foreach((GHFunc)G_CALLBACK(last_process), &maps_pid);
+}
+
+static void maps_run(int G_GNUC_UNUSED size) {
+    proc_get_maps(maps_pid, NULL, NULL);
+}
+
+static void foreach_run(int G_GNUC_UNUSED size) {
+    int count = 0;
+    proc_foreach((GHFunc)G_CALLBACK(count_process), &count);
+}
+
+static void predict_run(int G_GNUC_UNUSED size) {
+    preload_prophet_predict(NULL);
+}
+
+static void state_setup(int size) {
+    model_setup(size);
+    statefile = g_build_filename(g_get_tmp_dir(), "preload-bench.state", NULL);
+}
+
+static void state_run(int size) {
+    state->dirty = TRUE;
+    preload_state_save(statefile);
+    preload_state_free();
+    preload_state_load(statefile);
+    (void)size;
+}
+
+static void state_teardown(void) {
+    g_unlink(statefile);
+    g_free(statefile);
+    model_teardown();
+}
+
+/* pages in each of the files, and maps per file */
+#define BENCH_FILE_PAGES 16
+#define BENCH_FILE_MAPS 16
+
+static char* bench_file_path(int i) {
+    char name[32];
+
+    g_snprintf(name, sizeof(name), "lib%d.so", i);
+    return g_build_filename(filesdir, name, NULL);
+}
+
+/* maps of a few files each, a third of them adjacent to the previous, so
+ * that merging has something to do.  the files are real, made in a
+ * temporary directory, so that the reads and stats do happen. */
+static void readahead_setup(int size) {
+    GRand* rand = g_rand_new_with_seed(1);
+    size_t offset = 0;
+    gchar* contents;
+    int i;
+
+    filesdir = g_dir_make_tmp("preload-bench-XXXXXX", NULL);
+    if (!filesdir)
+        g_error("cannot make temporary directory");
+    nfiles = size / BENCH_FILE_MAPS + 1;
+    contents = g_malloc(BENCH_FILE_PAGES * 4096);
+    for (i = 0; i < nfiles; i++) {
+        char* path = bench_file_path(i);
+
+        memset(contents, i, BENCH_FILE_PAGES * 4096);
+        if (!g_file_set_contents(path, contents, BENCH_FILE_PAGES * 4096,
+                                 NULL))
+            g_error("cannot write %s", path);
+        g_free(path);
+    }
+    g_free(contents);
+
+    preload_state_load(NULL);
+    files = g_ptr_array_new();
+    for (i = 0; i < size; i++) {
+        char* path;
+
+        if (g_rand_int_range(rand, 0, 3) || offset >= BENCH_FILE_PAGES * 4096)
+            offset = g_rand_int_range(rand, 0, BENCH_FILE_PAGES) * 4096;
+        path = bench_file_path(g_rand_int_range(rand, 0, nfiles));
+        g_ptr_array_add(files, preload_map_new(path, offset, 4096));
+        g_free(path);
+        offset += 4096;
+    }
+    g_rand_free(rand);
+}
+
+static void readahead_run(int G_GNUC_UNUSED size) {
+    guint i;
+
+    /* as fresh from the model, so that block sorting stats them */
+    for (i = 0; i < files->len; i++) {
+        preload_map_t* map = g_ptr_array_index(files, i);
+        map->block = -1;
+    }
+    preload_readahead((preload_map_t**)files->pdata, files->len);
+}
+
+static void readahead_path_setup(int size) {
+    readahead_setup(size);
+    conf->system.sortstrategy = SORT_PATH;
+}
+
+static void readahead_block_setup(int size) {
+    readahead_setup(size);
+    conf->system.sortstrategy = SORT_BLOCK;
+}
+
+static void readahead_teardown(void) {
+    int i;
+
+    g_ptr_array_foreach(files, (GFunc)G_CALLBACK(preload_map_free), NULL);
+    g_ptr_array_free(files, TRUE);
+    preload_state_free();
+
+    for (i = 0; i < nfiles; i++) {
+        char* path = bench_file_path(i);
+        g_unlink(path);
+        g_free(path);
+    }
+    g_rmdir(filesdir);
+    g_free(filesdir);
+}
+
+static const bench_t benches[] = {
+    {"maps", "1", "processes", maps_setup, maps_run, NULL},
+    {"foreach", "1", "scans", NULL, foreach_run, NULL},
+    {"predict", "100,300,1000", "exes", model_setup, predict_run,
+     model_teardown},
+    {"state", "100,300,1000", "exes", state_setup, state_run, state_teardown},
+    {"readahead-path", "1000,10000", "maps", readahead_path_setup,
+     readahead_run, readahead_teardown},
+    {"readahead-block", "1000,10000", "maps", readahead_block_setup,
+     readahead_run, readahead_teardown},
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_run(const bench_t* bench, int size) {
+    double total = 0, best = 0;
+    long iterations = 0;
+    int r;
+
+    if (bench->setup)
+        bench->setup(size);
+
+    /* once to warm the caches up */
+    bench->run(size);
+
+    for (r = 0; r < repeats; r++) {
+        double start = now(), elapsed;
+        long n = 0;
+
+        do {
+            bench->run(size);
+            n++;
+        } while ((elapsed = now() - start) < mintime);
+
+        if (!r || elapsed / n < best)
+            best = elapsed / n;
+        total += elapsed;
+        iterations += n;
+    }
+
+    if (bench->teardown)
+        bench->teardown();
+
+    printf("{\"name\": \"%s\", \"size\": %d, \"unit\": \"%s\", "
+           "\"iterations\": %ld, \"ns_per_op\": %.0lf, "
+           "\"min_ns_per_op\": %.0lf}\n",
+           bench->name, size, bench->unit, iterations,
+           1e9 * total / iterations, 1e9 * best);
+    fflush(stdout);
+}
+
+static void usage(const char* prog) {
+    guint i;
+
+    fprintf(stderr,
+            "Usage: %s [-r repeats] [-t mintime] [-d density | -s statefile] "
+            "[-p procroot] case [size...]\n",
+            prog);
+    fprintf(stderr, "Cases:");
+    for (i = 0; i < G_N_ELEMENTS(benches); i++)
+        fprintf(stderr, " %s", benches[i].name);
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+    const bench_t* bench = NULL;
+    guint i;
+
+    for (;;) {
+        int c = getopt(argc, argv, "r:t:d:s:p:");
+        if (c == -1)
+            break;
+        switch (c) {
+            case 'r':
+                repeats = strtol(optarg, NULL, 10);
+                break;
+            case 't':
+                mintime = g_ascii_strtod(optarg, NULL);
+                break;
+            case 'd':
+                density = g_ascii_strtod(optarg, NULL);
+                break;
+            case 's':
+                modelfile = optarg;
+                break;
+            case 'p':
+                proc_set_root(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind >= argc || repeats <= 0)
+        usage(argv[0]);
+
+    for (i = 0; i < G_N_ELEMENTS(benches); i++)
+        if (!strcmp(argv[optind], benches[i].name))
+            bench = &benches[i];
+    if (!bench)
+        usage(argv[0]);
+
+    /* warnings and worse only */
+    preload_log_level = 2;
+    preload_log_init(NULL);
+    preload_conf_load(NULL, TRUE);
+    /* never fork readers, the time is in the parent */
+    conf->system.maxprocs = 0;
+
+    if (modelfile) {
+        /* one size only, that of the model */
+        preload_state_load(modelfile);
+        i = g_hash_table_size(state->exes);
+        preload_state_free();
+        bench_run(bench, i);
+    } else if (optind + 1 < argc) {
+        for (i = optind + 1; i < (guint)argc; i++)
+            bench_run(bench, strtol(argv[i], NULL, 10));
+    } else {
+        char** sizes = g_strsplit(bench->sizes, ",", 0);
+        char** size;
+
+        for (size = sizes; *size; size++)
+            bench_run(bench, strtol(*size, NULL, 10));
+        g_strfreev(sizes);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -13,7 +13,12 @@
 
 #define signed_integer_percent 1
 
+#define kilobytes_per_second 1024
+#define requests_per_second 1
+
 #define processes 1
+#define executables 1
+#define descriptors 1
 
 typedef struct _preload_conf_t {
     /* conf values.  see preload.conf for a description of these */
@@ -23,18 +28,43 @@ typedef struct _preload_conf_t {
     struct _conf_model {
         int cycle;
         gboolean usecorrelation;
+        gboolean usemapprob;
+
+        /* weights of the prediction models, in percent */
+        int markov;
+        int seasonal;
+        int ngram;
+        int ngramorder;
+        int spawn;
 
         int minsize;
+        int badexettl;
+        int badexemax;
 
         /* memory usage adjustment */
         int memtotal;
         int memfree;
         int memcached;
+        int memavailable;
+
+        /* stall percentage above which prefetching stops, 0 for never */
+        int mempressure;
+
+        /* map selection for the readahead budget */
+        enum {
+            SELECT_GREEDY = 0,
+            SELECT_KNAPSACK = 1
+        } selectstrategy;
+
+        /* readahead effectiveness feedback */
+        int prefetchwindow;
+        int wastepenalty;
     } model;
 
     struct _conf_system {
         gboolean doscan;
         gboolean dopredict;
+        gboolean prefetchonexec;
         int autosave;
 
         char** mapprefix;
@@ -45,8 +75,20 @@ typedef struct _preload_conf_t {
             SORT_NONE = 0,
             SORT_PATH = 1,
             SORT_INODE = 2,
-            SORT_BLOCK = 3
+            SORT_BLOCK = 3,
+            SORT_AUTO = 4
         } sortstrategy;
+        int readgap;
+        int chunksize;
+        int fdcache;
+        int filecheck;
+
+        /* readahead I/O budget, see iobudget.c */
+        int iorate;
+        int iops;
+        gboolean ioidle;
+        int iopressure;
+        int ioutil;
     } system;
 
 } preload_conf_t;
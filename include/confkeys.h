@@ -1,13 +1,36 @@
 confkey(model, integer, cycle, 20, seconds);
 confkey(model, boolean, usecorrelation, true, -);
+confkey(model, boolean, usemapprob, true, -);
+confkey(model, integer, markov, 100, signed_integer_percent);
+confkey(model, integer, seasonal, 0, signed_integer_percent);
+confkey(model, integer, ngram, 0, signed_integer_percent);
+confkey(model, integer, ngramorder, 2, executables);
+confkey(model, integer, spawn, 100, signed_integer_percent);
 confkey(model, integer, minsize, 2000000, bytes);
+confkey(model, integer, badexettl, 86400, seconds);
+confkey(model, integer, badexemax, 4096, executables);
 confkey(model, integer, memtotal, -10, signed_integer_percent);
 confkey(model, integer, memfree, 50, signed_integer_percent);
 confkey(model, integer, memcached, 0, signed_integer_percent);
+confkey(model, integer, memavailable, 0, signed_integer_percent);
+confkey(model, integer, mempressure, 10, signed_integer_percent);
+confkey(model, enum, selectstrategy, 0, -);
+confkey(model, integer, prefetchwindow, 600, seconds);
+confkey(model, integer, wastepenalty, 0, signed_integer_percent);
 confkey(system, boolean, doscan, true, -);
 confkey(system, boolean, dopredict, true, -);
+confkey(system, boolean, prefetchonexec, true, -);
 confkey(system, integer, autosave, 3600, seconds);
 confkey(system, string_list, mapprefix, NULL, -);
 confkey(system, string_list, exeprefix, NULL, -);
 confkey(system, integer, maxprocs, 30, processes);
-confkey(system, enum, sortstrategy, 3, -);
+confkey(system, enum, sortstrategy, 4, -);
+confkey(system, integer, readgap, 128, kilobytes);
+confkey(system, integer, chunksize, 2048, kilobytes);
+confkey(system, integer, fdcache, 512, descriptors);
+confkey(system, integer, filecheck, 3600, seconds);
+confkey(system, integer, iorate, 0, kilobytes_per_second);
+confkey(system, integer, iops, 0, requests_per_second);
+confkey(system, boolean, ioidle, true, -);
+confkey(system, integer, iopressure, 20, signed_integer_percent);
+confkey(system, integer, ioutil, 0, signed_integer_percent);
@@ -0,0 +1,22 @@
+#ifndef FDCACHE_H
+#define FDCACHE_H
+
+#include <state.h>
+
+/* Read only descriptors of the files readahead keeps coming back to, kept
+ * open across cycles, at most conf->system.fdcache of them, closing the
+ * least recently used first.  A descriptor is checked against its path
+ * at most once a second, and reopened if the path now names another
+ * file, as after a package upgrade. */
+
+/* returns a descriptor of path, or -1 if it cannot be opened.  it belongs
+ * to the cache: do not close it, and do not use it after the next call */
+int preload_fdcache_open(const char* path);
+
+/* closes the descriptors not used for a couple of cycles, so as not to
+ * hold on to files deleted since */
+void preload_fdcache_expire(void);
+
+void preload_fdcache_free(void);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef IDENTITY_H
+#define IDENTITY_H
+
+#include <state.h>
+
+/* Keeps track of which files the paths of maps and exes name, by device,
+ * inode, size and modification time, so that upgrades replacing them are
+ * noticed.  The directories they are in are watched with inotify, and
+ * every file is also checked with stat once every conf->system.filecheck
+ * seconds, a few of them every cycle, in case an event was missed.
+ *
+ * A map whose file changed or went away is dropped from the exes using
+ * it, and an exe whose file did has all its maps dropped; either way the
+ * exe gets its maps read again from its next process.  An exe found too
+ * small whose file did is forgotten, to be looked at again likewise. */
+
+/* checks what is due, and what the directory watches reported */
+void preload_identity_check(void);
+
+void preload_identity_free(void);
+
+#endif
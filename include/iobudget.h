@@ -0,0 +1,21 @@
+#ifndef IOBUDGET_H
+#define IOBUDGET_H
+
+#include <state.h>
+
+/* A token bucket of bytes and requests per second for readahead, refilled
+ * continuously up to a cycle's worth, and cut back while the disks are
+ * busy with someone else's I/O, as told by /proc/pressure/io and the
+ * utilization of the block devices. */
+
+/* returns how many of files, taken in order, fit in what is left of the
+ * budget, and takes that much of it */
+int preload_iobudget_take(preload_map_t** files, int file_count);
+
+/* puts the calling process in the idle I/O scheduling class, if
+ * conf->system.ioidle.  returns the previous priority to restore with
+ * preload_iobudget_restore, or -1 if unchanged */
+int preload_iobudget_idle(void);
+void preload_iobudget_restore(int ioprio);
+
+#endif
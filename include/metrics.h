@@ -0,0 +1,71 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "common.h"
+
+/* Counters, gauges and per-phase latency histograms of the daemon,
+ * written out every cycle in the Prometheus text exposition format, for
+ * the node exporter's textfile collector or anything else to scrape. */
+
+/* phases of a cycle, timed into histograms */
+typedef enum {
+    METRIC_PHASE_SCAN,
+    METRIC_PHASE_UPDATE,
+    METRIC_PHASE_PREDICT,
+    METRIC_PHASE_READAHEAD,
+    METRIC_PHASE_SAVE,
+    METRIC_PHASES
+} preload_metric_phase_t;
+
+/* ever increasing counts */
+typedef enum {
+    METRIC_PROCESSES,           /* processes scanned */
+    METRIC_MAPS,                /* maps of processes read */
+    METRIC_MAPS_ALIASED,        /* map lines of a file known by another path */
+    METRIC_FOREIGN_UNRESOLVED,  /* foreign maps and exes not found here */
+    METRIC_READAHEAD_BYTES,     /* bytes asked to be read in */
+    METRIC_READAHEAD_MAPS,      /* maps asked to be read in */
+    METRIC_READAHEAD_RANGES,    /* ranges read in, after merging */
+    METRIC_READAHEAD_RUNS,      /* runs of ranges adjacent on disk */
+    METRIC_READAHEAD_MERGED,    /* ranges merged into the previous one */
+    METRIC_READAHEAD_FORKS,     /* reader processes forked */
+    METRIC_READAHEAD_CANCELLED, /* ranges not read for memory pressure */
+    METRIC_READAHEAD_THROTTLED, /* maps left out by the I/O budget */
+    METRIC_FDCACHE_HITS,        /* files found open in the cache */
+    METRIC_FDCACHE_OPENS,       /* files opened for the cache */
+    METRIC_STALE_FILES,         /* maps and exes whose files changed */
+    METRIC_BAD_EXE_HITS,        /* processes of exes known to be too small */
+    METRIC_MAPS_READS_AVOIDED,  /* of those, maps reads of new exes saved */
+    METRIC_PREFETCH_MAPS,       /* maps read in ahead of their use */
+    METRIC_PREFETCH_HITS,       /* of those, used while still cached */
+    METRIC_PREFETCH_EVICTED,    /* of those, evicted before a use */
+    METRIC_PREFETCH_WASTED,     /* of those, not used in time */
+    METRIC_COUNTERS
+} preload_metric_counter_t;
+
+/* values as of the last cycle */
+typedef enum {
+    METRIC_MEMAVAIL,         /* bytes we were allowed to prefetch */
+    METRIC_MEMUSED,          /* of those, bytes selected for prefetching */
+    METRIC_EXES,             /* exes known */
+    METRIC_BAD_EXES,         /* exes ignored */
+    METRIC_MAPS_KNOWN,       /* maps known */
+    METRIC_RUNNING,          /* exes running */
+    METRIC_PREFETCH_PENDING, /* maps read in, waiting for a use */
+    METRIC_QUEUE_CHUNKS,     /* chunks queued, not read yet */
+    METRIC_GAUGES
+} preload_metric_gauge_t;
+
+void preload_metrics_begin(preload_metric_phase_t phase);
+void preload_metrics_end(preload_metric_phase_t phase);
+void preload_metrics_count(preload_metric_counter_t counter, guint64 n);
+void preload_metrics_set(preload_metric_gauge_t gauge, double value);
+
+/* starts writing metrics to metricsfile.  returns FALSE if failed */
+gboolean preload_metrics_open(const char* metricsfile);
+void preload_metrics_close(void);
+
+/* (re)writes the metrics file, if any, replacing it atomically */
+void preload_metrics_write(void);
+
+#endif
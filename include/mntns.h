@@ -0,0 +1,38 @@
+#ifndef MNTNS_H
+#define MNTNS_H
+
+#include "common.h"
+
+/* Processes of other mount namespaces, those of containers mostly, see
+ * files by paths of their own, which mean nothing here, or another file.
+ * Their maps and exes are found on our side by going through the mounts
+ * the process sees: the layers of an overlay, or wherever else the
+ * filesystem mounted there is mounted here, checking the candidates with
+ * stat against what the process itself sees through /proc/PID/root.
+ *
+ * Whatever is found is kept, so this is mostly a lookup; containers of
+ * the same image then share the files of its layers, and their maps. */
+
+/* returns the inode of our mount namespace, or 0 if it cannot be told,
+ * as with a made up procfs */
+guint64 preload_mntns_own(void);
+
+/* returns the mount namespace of the process, or 0 if it is ours or it
+ * cannot be told */
+guint64 preload_mntns_of(pid_t pid);
+
+/* returns our path of the file the process of namespace ns knows as
+ * path, whose device and inode are the ones it reports in its maps, or
+ * NULL if not found.  the device and inode of that path go to host_dev
+ * and host_ino.  the path is only valid until the next call */
+const char* preload_mntns_resolve(pid_t pid,
+                                  guint64 ns,
+                                  dev_t dev,
+                                  ino_t ino,
+                                  const char* path,
+                                  dev_t* host_dev,
+                                  ino_t* host_ino);
+
+void preload_mntns_free(void);
+
+#endif
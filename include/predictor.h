@@ -0,0 +1,62 @@
+#ifndef PREDICTOR_H
+#define PREDICTOR_H
+
+#include <state.h>
+
+/* preload_predictor_t: a prediction model.  every model observes the
+ * same events, and bids in exes; the bids are blended with the weight
+ * configured for each model. */
+typedef struct _preload_predictor_t {
+    const char* name;
+    const int* weight; /* conf value, percent.  0 turns bidding off. */
+
+    /* set up and tear down private data, around the state. */
+    void (*init)(void);
+    void (*free)(void);
+
+    /* an exe started or stopped running. */
+    void (*exe_changed)(preload_exe_t* exe);
+
+    /* a process of the exe at path showed up, tracked or not, forked by
+     * a process of the exe at parent if that is known, delay seconds
+     * after the parent process started.  called at scan time, right
+     * before the prediction. */
+    void (*spawned)(const char* path, const char* parent, int delay);
+
+    /* period seconds of accounting have passed. */
+    void (*tick)(int period);
+
+    /* adds weight * log(P(Y=0)) to lnprob of every exe Y it predicts. */
+    void (*bid)(double weight);
+
+    /* state file lines owned by this model, NULL terminated.  read gets
+     * a line of one of those tags without the tag, and the exes indexed
+     * by their seq in the file, and returns an error message or NULL.
+     * write appends complete lines, tag included, to out. */
+    const char* const* tags;
+    const char* (*read)(const char* tag, char* line, GHashTable* exes);
+    void (*write)(GString* out);
+} preload_predictor_t;
+
+extern const preload_predictor_t preload_markov_predictor;
+extern const preload_predictor_t preload_seasonal_predictor;
+extern const preload_predictor_t preload_ngram_predictor;
+extern const preload_predictor_t preload_spawn_predictor;
+
+void preload_predictors_init(void);
+void preload_predictors_free(void);
+void preload_predictors_exe_changed(preload_exe_t* exe);
+void preload_predictors_spawned(const char* path,
+                                const char* parent,
+                                int delay);
+void preload_predictors_tick(int period);
+void preload_predictors_bid(void);
+
+/* returns TRUE if tag belongs to a model, setting *errmsg on failure */
+gboolean preload_predictors_read(const char* tag,
+                                 char* line,
+                                 GHashTable* exes,
+                                 const char** errmsg);
+void preload_predictors_write(GString* out);
+
+#endif
@@ -12,6 +12,9 @@
 extern const char* conffile;
 extern const char* statefile;
 extern const char* logfile;
+extern const char* tracefile;
+extern const char* procroot;
+extern const char* metricsfile;
 extern int foreground;
 extern int nicelevel;
 
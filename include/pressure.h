@@ -0,0 +1,24 @@
+#ifndef PRESSURE_H
+#define PRESSURE_H
+
+#include "common.h"
+
+/* Memory pressure, from the pressure stall information of the kernel.
+ * While tasks are stalling on memory, prefetching only makes it worse,
+ * evicting pages that someone is about to fault back in. */
+
+/* watches for memory stalls above conf->model.mempressure with a PSI
+ * trigger in the main loop.  falls back to polling the averages if
+ * triggers are not allowed, and does nothing without PSI at all */
+void preload_pressure_open(void);
+void preload_pressure_close(void);
+
+/* TRUE while memory is under pressure.  cheap enough to call between
+ * readaheads */
+gboolean preload_pressure_high(void);
+
+/* share of the last 10s, in percent, some task stalled on resource, one
+ * of cpu, memory and io.  -1 if not known */
+double preload_pressure_avg10(const char* resource);
+
+#endif
@@ -13,18 +13,54 @@ typedef struct _preload_memory_t {
     int free_;   /* free memory */
     int buffers; /* buffers memory */
     int cached;  /* page-cache memory */
+    int available; /* estimate of memory available without swapping, or
+                      0 if not known */
 
     int pagein;  /* total data paged (read) in since boot */
     int pageout; /* total data paged (written) out since boot */
 
 } preload_memory_t;
 
+#define DEFAULT_PROCROOT "/proc"
+
+/* reads everything from the procfs mounted at root instead of
+ * DEFAULT_PROCROOT.  relative to the current directory if not absolute */
+void proc_set_root(const char* root);
+const char* proc_get_root(void);
+
 /* read system memory information */
 void proc_get_memstat(preload_memory_t* mem);
 
-/* returns sum of length of maps, in bytes, or 0 if failed */
+/* reads the parent pid and the start time, in seconds since boot, of a
+ * process.  returns FALSE if failed */
+gboolean proc_get_stat(pid_t pid, pid_t* ppid, double* starttime);
+
+/* the accepted maps of a process as read, before any is made a
+ * preload_map_t, in memory kept from one read to the next */
+typedef struct _proc_maps_t proc_maps_t;
+
+/* returns the proc_maps_t shared by everything reading maps, one
+ * process at a time, until proc_maps_scratch_free */
+proc_maps_t* proc_maps_scratch(void);
+void proc_maps_scratch_free(void);
+
+/* reads the maps of the process into maps, replacing what they had.
+ * returns the sum of their lengths, in bytes, or 0 if failed */
+size_t proc_maps_read(proc_maps_t* maps, pid_t pid);
+
+/* returns a new set of exemaps of the maps read, of the map found in
+ * known if any, or of a new one otherwise */
+GSet* proc_maps_exemaps(proc_maps_t* maps, GHashTable* known);
+
+/* reads the maps of the process, and if exemaps is given, sets it to a
+ * new set of exemaps of them, as proc_maps_exemaps does.  returns sum of
+ * length of maps, in bytes, or 0 if failed */
 size_t proc_get_maps(pid_t pid, GHashTable* maps, GSet** exemaps);
 
+/* returns the set of maps of the process that have pages resident in its
+ * address space, as preload_map_t keys, or NULL if failed */
+GHashTable* proc_get_maps_usage(pid_t pid);
+
 /* foreach process running, passes pid as key and exe path as value */
 void proc_foreach(GHFunc func, gpointer user_data);
 
@@ -4,4 +4,13 @@
 void preload_prophet_predict(gpointer data);
 void preload_prophet_readahead(GPtrArray* maps_arr);
 
+/* picks maps from maps_arr (sorted on the need) to fit memavail kilobytes,
+ * appending them to selected.  returns the kilobytes left unused. */
+int preload_prophet_select(GPtrArray* maps_arr,
+                           int memavail,
+                           GPtrArray* selected);
+
+/* expected number of bytes of selected maps needed in next period */
+double preload_prophet_expected_hit(GPtrArray* selected);
+
 #endif
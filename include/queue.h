@@ -0,0 +1,25 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <state.h>
+
+/* The prefetch queue: the maps selected for prefetching, cut in chunks of
+ * at most chunksize, read in order of need for as long as the I/O budget
+ * and memory pressure allow.  Whatever is left waits for the next cycle,
+ * when it is reordered by the need then, or dropped if its map is not
+ * selected anymore. */
+
+/* makes selected, in order of need, what is queued.  chunks read already
+ * of maps still selected are not read again */
+void preload_queue_update(GPtrArray* selected);
+
+/* reads as much of the queue as allowed, calling done for every map read
+ * all of.  returns the number of chunks read */
+int preload_queue_run(GFunc done, gpointer data);
+
+/* chunks queued, not read yet */
+int preload_queue_length(void);
+
+void preload_queue_free(void);
+
+#endif
@@ -3,6 +3,18 @@
 
 #include <state.h>
 
+/* reads files in, sorted for the disks, stopping if memory pressure
+ * rises.  returns the number of ranges read */
 int preload_readahead(preload_map_t** files, int file_count);
 
+/* same, but reads all of files whatever the pressure, for callers that
+ * look at it themselves and need to know what was read */
+int preload_readahead_all(preload_map_t** files, int file_count);
+
+/* returns TRUE if all of the map is in the page cache already */
+gboolean preload_readahead_is_cached(const preload_map_t* map);
+
+/* prints how each device is read from */
+void preload_readahead_dump_log(void);
+
 #endif
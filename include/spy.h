@@ -4,5 +4,6 @@
 
 void preload_spy_scan(gpointer data);
 void preload_spy_update_model(gpointer data);
+void preload_spy_free(void);
 
 #endif
@@ -3,6 +3,15 @@
 
 #include <proc.h>
 
+/* preload_identity_t: the file a path named when last checked, see
+ * identity.c.  ino is 0 if not known yet. */
+typedef struct _preload_identity_t {
+    guint64 dev;
+    guint64 ino;
+    gint64 size;
+    gint64 mtime; /* in nanoseconds. */
+} preload_identity_t;
+
 /* preload_map_t: structure holding information
  * about a mapped section. */
 typedef struct _preload_map_t {
@@ -11,12 +20,23 @@ typedef struct _preload_map_t {
     size_t length;   /* in bytes. */
     int update_time; /* last time it was probed. */
 
+    /* readahead effectiveness, see prophet.c: */
+    int prefetched; /* times read in ahead of any exe using it. */
+    int hits;       /* of those, times an exe using it started in time. */
+    int evicted;    /* of those, times it left the cache before that. */
+    int wasted;     /* of those, times nothing used it in time. */
+    preload_identity_t id; /* of the file. */
+
     /* runtime: */
     int refcount;  /* number of exes linking to this. */
     double lnprob; /* log-probability of NOT being needed in next period. */
     int seq;       /* unique map sequence number. */
-    int block;     /* on-disk location of the start of the map. */
+    gint64 block;  /* on-disk location of the start of the map, in bytes if
+                      physical, else its inode number, or -1 if unknown. */
+    gboolean physical; /* whether block is a disk address. */
     int priv;      /* for private local use of functions. */
+    int prefetch_time; /* when read in, if still waiting for a use, or -1. */
+    int check_time;    /* when its identity was last checked, or -1. */
 } preload_map_t;
 
 /* preload_exemap_t: structure holding information
@@ -26,6 +46,13 @@ typedef struct _preload_exemap_t {
     double prob; /* probability that this map is used when exe is running. */
 } preload_exemap_t;
 
+/* weight of a new usage sample in exemap->prob, the rest being history.
+ * maps less likely than that went unused the last several runs. */
+#define MAPPROB_LEARNING_RATE 0.25
+
+/* number of hour-of-week slots in seasonal launch histograms. */
+#define HOURS_PER_WEEK (7 * 24)
+
 /* preload_exe_t: structure holding information
  * about an executable. */
 typedef struct _preload_exe_t {
@@ -34,6 +61,11 @@ typedef struct _preload_exe_t {
     int update_time; /* last time it was probed. */
     GSet* markovs;   /* set of markov chains with other exes. */
     GSet* exemaps;   /* set of exemap structures. */
+    int* launches;   /* number of launches in each hour-of-week slot, or
+                        NULL if never seen launching. */
+    preload_identity_t id; /* of the file. */
+    gboolean reprobe; /* whether its maps are to be read again from its
+                         next process, the files having changed. */
 
     /* runtime: */
     size_t size;           /* sum of the size of the maps, in bytes. */
@@ -41,10 +73,24 @@ typedef struct _preload_exe_t {
     int change_timestamp;  /* time started/stopped running. */
     double lnprob; /* log-probability of NOT being needed in next period. */
     int seq;       /* unique exe sequence number. */
+    pid_t pid;     /* a process running this exe, last time we checked. */
+    int check_time; /* when its identity was last checked, or -1. */
 } preload_exe_t;
 #define exe_is_running(exe) \
     ((exe)->running_timestamp >= state->last_running_timestamp)
 
+/* preload_badexe_t: an exe too small to be worth preloading, kept so as
+ * not to read its maps again every time it runs. */
+typedef struct _preload_badexe_t {
+    int size;              /* sum of the length of the maps, in bytes. */
+    int update_time;       /* when it was found too small. */
+    preload_identity_t id; /* of the file. */
+
+    /* runtime: */
+    int check_time; /* when its identity was last checked, or -1. */
+    int hit_time;   /* last time a process of it was scanned, or -1. */
+} preload_badexe_t;
+
 /* preload_markov_t: a 4-state continuous-time Markov chain. */
 typedef struct _preload_markov_t {
     preload_exe_t *a, *b; /* involved exes. */
@@ -85,18 +131,27 @@ typedef struct _preload_state_t {
     /* set of applications that preload is not interested
      * in. typically it is the case that these applications
      * are too small to be a candidate for preloading.
-     * mapped value is the size of the binary (sum of the
-     * length of the maps. */
+     * indexed by exe name, to a preload_badexe_t structure,
+     * forgotten conf->model.badexettl seconds later. */
     GHashTable* bad_exes;
 
     /* set of maps used by known executables, indexed by
      * preload_map_t structures. */
     GHashTable* maps;
 
+    /* seconds preload has been watching in each hour-of-week slot, the
+     * exposure against which exe launches are counted. */
+    int exposure[HOURS_PER_WEEK];
+
     /* runtime: */
 
-    GSList* running_exes; /* set of exe structs currently running. */
+    GSList* running_exes;  /* set of exe structs currently running. */
+    GSList* launched_exes; /* set of exes that started running in the
+                              last scan. */
     GPtrArray* maps_arr;  /* set of maps again, in a sortable array. */
+    GHashTable* files;    /* path maps of a file go by, indexed by the
+                             preload_identity_t of the file, dev and ino
+                             only. */
 
     int map_seq; /* increasing sequence of unique numbers to assign to maps. */
     int exe_seq; /* increasing sequence of unique numbers to assign to exes. */
@@ -127,8 +182,23 @@ void preload_state_free(void);
 void preload_state_register_exe(preload_exe_t* exe, gboolean create_markovs);
 void preload_state_unregister_exe(preload_exe_t* exe);
 
+/* remembers path as that of an exe whose maps sum up to size only,
+ * forgetting the oldest ones past conf->model.badexemax */
+void preload_state_register_badexe(const char* path, int size);
+
 /* map */
 
+/* returns the path maps of the file with dev and ino go by: the first
+ * path it was seen at, if it is still there, so that the same file
+ * reached through bind mounts or from another mount namespace makes the
+ * same maps.  otherwise path, which it goes by from now on.  ino is 0 if
+ * not known, and then path is returned */
+const char* preload_state_map_path(guint64 dev, guint64 ino, const char* path);
+
+/* forgets that maps of the file with dev and ino go by path, the file
+ * being gone from there or another one now */
+void preload_state_forget_path(guint64 dev, guint64 ino, const char* path);
+
 /* duplicates path */
 preload_map_t* preload_map_new(const char* path, size_t offset, size_t length);
 void preload_map_free(preload_map_t* map);
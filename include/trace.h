@@ -0,0 +1,78 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <time.h>
+
+#include <state.h>
+
+/* A trace is a compact binary recording of everything the daemon read
+ * from /proc: for every scan, the running processes and the maps, map
+ * usage, process stats and memory stats it looked at.  Replaying a trace
+ * serves the proc_* functions from it instead of /proc, so that the
+ * model can be driven offline on a virtual clock. */
+
+/* recording */
+
+/* starts recording to tracefile, truncating it.  returns FALSE if
+ * failed */
+gboolean preload_trace_open(const char* tracefile);
+void preload_trace_close(void);
+
+/* called by the spy at the start of every scan */
+void preload_trace_scan(int time, time_t wallclock);
+
+/* called by the proc layer with what it read */
+void preload_trace_proc(pid_t pid, const char* path);
+void preload_trace_stat(pid_t pid, pid_t ppid, double starttime);
+void preload_trace_memstat(const preload_memory_t* mem);
+
+/* maps and usage of a process are recorded as a list of maps */
+void preload_trace_maps_begin(pid_t pid, gboolean usage);
+void preload_trace_map(const char* path, size_t offset, size_t length);
+void preload_trace_maps_end(void);
+
+/* replaying */
+
+typedef struct _preload_trace_hooks_t {
+    /* instead of reading files in */
+    void (*readahead)(preload_map_t** files, int file_count);
+    /* instead of checking the page cache */
+    gboolean (*is_cached)(const preload_map_t* map);
+} preload_trace_hooks_t;
+
+/* starts replaying tracefile.  returns FALSE if failed */
+gboolean preload_trace_replay_open(const char* tracefile,
+                                   const preload_trace_hooks_t* hooks);
+void preload_trace_replay_close(void);
+
+/* loads the records of the next scan, and sets time to the state time
+ * it happened at.  returns FALSE at the end of the trace */
+gboolean preload_trace_replay_step(int* time);
+
+gboolean preload_trace_replaying(void);
+const preload_trace_hooks_t* preload_trace_replay_hooks(void);
+
+typedef void (*preload_trace_proc_func_t)(pid_t pid,
+                                          const char* path,
+                                          gpointer user_data);
+typedef void (*preload_trace_map_func_t)(const char* path,
+                                         size_t offset,
+                                         size_t length,
+                                         gpointer user_data);
+
+/* what the proc layer returns when replaying.  maps calls func for every
+ * map recorded for pid, or its usage, and returns FALSE if none was. */
+void preload_trace_replay_foreach(preload_trace_proc_func_t func,
+                                  gpointer user_data);
+gboolean preload_trace_replay_maps(pid_t pid,
+                                   gboolean usage,
+                                   preload_trace_map_func_t func,
+                                   gpointer user_data);
+gboolean preload_trace_replay_stat(pid_t pid, pid_t* ppid, double* starttime);
+void preload_trace_replay_memstat(preload_memory_t* mem);
+
+/* wall-clock time as seen by the model: the recorded one when
+ * replaying, the current one otherwise */
+time_t preload_trace_wallclock(void);
+
+#endif
@@ -12,6 +12,15 @@ test_normal() {
     $APPNAME -c preload.conf -s '' -l '' -f
 }
 
+# the daemon against a made up procfs, which it should learn exes from
+test_fakeproc() {
+    rm -rf fakeproc fakeproc.state
+    $GENNAME -e 50 -n 200 -P fakeproc
+    ( sleep 2; killall $APPNAME 2>/dev/null ) &
+    $APPNAME -c preload.conf -s fakeproc.state -l '' -f --procroot fakeproc
+    grep -q "$(printf '^EXE\t')" fakeproc.state
+}
+
 main() {
     case $1 in
         debug)
@@ -20,6 +29,9 @@ main() {
         normal)
             test_normal
             ;;
+        fakeproc)
+            test_fakeproc
+            ;;
         *)
             return 1
             ;;
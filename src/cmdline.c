@@ -26,6 +26,7 @@
 
 #include "common.h"
 #include "preload.h"
+#include "proc.h"
 
 #define DEFAULT_LOGLEVEL_STRING STRINGIZE(DEFAULT_LOGLEVEL)
 #define DEFAULT_NICELEVEL_STRING STRINGIZE(DEFAULT_NICELEVEL)
@@ -37,7 +38,9 @@ static const struct option opts[] = {
     {"conffile", 1, 0, 'c'}, {"statefile", 1, 0, 's'},
     {"logfile", 1, 0, 'l'},  {"foreground", 0, 0, 'f'},
     {"nice", 1, 0, 'n'},     {"verbose", 1, 0, 'V'},
-    {"debug", 0, 0, 'd'},    {NULL, 0, 0, 0},
+    {"debug", 0, 0, 'd'},    {"tracefile", 1, 0, 't'},
+    {"procroot", 1, 0, 'p'}, {"metricsfile", 1, 0, 'm'},
+    {NULL, 0, 0, 0},
 };
 
 static const char* help2man_str =
@@ -54,6 +57,10 @@ static const char* opts_help[] = {
     "Nice level.",                          /* nice */
     "Set the verbosity level.  Levels 0 to 10 are recognized.", /* verbose */
     "Debug mode: --logfile '' --foreground --verbose 9",        /* debug */
+    "Record a trace of every scan to file, for preload-sim.",   /* tracefile */
+    "Read processes and memory stats from this procfs.",        /* procroot */
+    "Write metrics every cycle to file, in Prometheus format.", /* metricsfile
+                                                                  */
 };
 static const char* opts_default[] = {
     NULL,                     /* help */
@@ -65,15 +72,31 @@ static const char* opts_default[] = {
     DEFAULT_NICELEVEL_STRING, /* nice */
     DEFAULT_LOGLEVEL_STRING,  /* verbose */
     NULL,                     /* debug */
+    NULL,                     /* tracefile */
+    DEFAULT_PROCROOT,         /* procroot */
+    NULL,                     /* metricsfile */
 };
 
 static void version_func(void) G_GNUC_NORETURN;
 static void help_func(gboolean err, gboolean help2man) G_GNUC_NORETURN;
 
+/* files opened after daemonizing, which chdirs to /, are taken relative
+ * to the current directory now */
+static const char* absolute_path(const char* path) {
+    char *cwd, *abs;
+
+    if (!*path || g_path_is_absolute(path))
+        return path;
+    cwd = g_get_current_dir();
+    abs = g_build_filename(cwd, path, NULL);
+    g_free(cwd);
+    return abs;
+}
+
 void preload_cmdline_parse(int* argc, char*** argv) {
     for (;;) {
         int i;
-        i = getopt_long(*argc, *argv, "hHvc:s:l:fn:V:d", opts, NULL);
+        i = getopt_long(*argc, *argv, "hHvc:s:l:fn:V:dt:p:m:", opts, NULL);
         if (i == -1) {
             break;
         }
@@ -101,6 +124,15 @@ void preload_cmdline_parse(int* argc, char*** argv) {
                 foreground = 1;
                 preload_log_level = 9;
                 break;
+            case 't':
+                tracefile = absolute_path(optarg);
+                break;
+            case 'p':
+                procroot = optarg;
+                break;
+            case 'm':
+                metricsfile = absolute_path(optarg);
+                break;
             case 'v':
                 version_func();
             case 'H':
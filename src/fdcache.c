@@ -0,0 +1,165 @@
+/* fdcache.c - preload cache of open files
+ *
+ * This file is part of preload.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "fdcache.h"
+
+#include <sys/resource.h>
+
+#include "common.h"
+#include "conf.h"
+#include "log.h"
+#include "metrics.h"
+
+/* how often to check that a path still names the file open, at most */
+#define CHECK_US 1000000
+
+typedef struct _fdentry_t {
+    char* path;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    gint64 checked; /* when dev and ino were last compared to the path */
+    gint64 used;    /* when last handed out */
+    GList link;     /* in lru */
+} fdentry_t;
+
+static GHashTable* entries; /* path -> fdentry_t */
+static GQueue lru = G_QUEUE_INIT; /* most recently used first */
+
+static void entry_free(fdentry_t* entry) {
+    close(entry->fd);
+    g_free(entry->path);
+    g_free(entry);
+}
+
+static void entry_remove(fdentry_t* entry) {
+    g_queue_unlink(&lru, &entry->link);
+    /* frees it */
+    g_hash_table_remove(entries, entry->path);
+}
+
+/* half the descriptors we may have open, at most, leaving the rest to
+ * everything else */
+static guint limit(void) {
+    struct rlimit rlim;
+    guint max = MAX(1, conf->system.fdcache);
+
+    if (0 == getrlimit(RLIMIT_NOFILE, &rlim) && rlim.rlim_cur != RLIM_INFINITY)
+        max = MIN(max, MAX(1, rlim.rlim_cur / 2));
+    return max;
+}
+
+static int open_file(const char* path) {
+    int fd = open(path, O_RDONLY | O_NOCTTY | O_CLOEXEC
+#ifdef O_NOATIME
+                            | O_NOATIME
+#endif
+    );
+
+#ifdef O_NOATIME
+    /* only the owner of the file may ask for it */
+    if (fd < 0 && errno == EPERM)
+        fd = open(path, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+#endif
+    return fd;
+}
+
+/* TRUE if the path still names the file open */
+static gboolean entry_valid(fdentry_t* entry, gint64 now) {
+    struct stat buf;
+
+    if (now - entry->checked < CHECK_US)
+        return TRUE;
+    if (0 > stat(entry->path, &buf) || buf.st_dev != entry->dev ||
+        buf.st_ino != entry->ino)
+        return FALSE;
+    entry->checked = now;
+    return TRUE;
+}
+
+int preload_fdcache_open(const char* path) {
+    gint64 now = g_get_monotonic_time();
+    fdentry_t* entry;
+    struct stat buf;
+    guint max;
+    int fd;
+
+    if (!entries)
+        entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                        (GDestroyNotify)entry_free);
+
+    entry = g_hash_table_lookup(entries, path);
+    if (entry) {
+        if (entry_valid(entry, now)) {
+            entry->used = now;
+            g_queue_unlink(&lru, &entry->link);
+            g_queue_push_head_link(&lru, &entry->link);
+            preload_metrics_count(METRIC_FDCACHE_HITS, 1);
+            return entry->fd;
+        }
+        entry_remove(entry);
+    }
+
+    fd = open_file(path);
+    if (fd < 0)
+        return -1;
+    if (0 > fstat(fd, &buf)) {
+        close(fd);
+        return -1;
+    }
+    preload_metrics_count(METRIC_FDCACHE_OPENS, 1);
+
+    max = limit();
+    while (lru.length >= max)
+        entry_remove(lru.tail->data);
+
+    entry = g_new0(fdentry_t, 1);
+    entry->path = g_strdup(path);
+    entry->fd = fd;
+    entry->dev = buf.st_dev;
+    entry->ino = buf.st_ino;
+    entry->checked = entry->used = now;
+    entry->link.data = entry;
+    g_hash_table_insert(entries, entry->path, entry);
+    g_queue_push_head_link(&lru, &entry->link);
+    return fd;
+}
+
+void preload_fdcache_expire(void) {
+    gint64 now = g_get_monotonic_time();
+    gint64 age = 2 * (gint64)conf->model.cycle * G_USEC_PER_SEC;
+
+    /* with no cache asked for, the last one handed out is still open */
+    if (!conf->system.fdcache)
+        age = 0;
+
+    while (lru.tail && now - ((fdentry_t*)lru.tail->data)->used >= age)
+        entry_remove(lru.tail->data);
+}
+
+void preload_fdcache_free(void) {
+    if (!entries)
+        return;
+
+    while (lru.tail)
+        entry_remove(lru.tail->data);
+    g_hash_table_destroy(entries);
+    entries = NULL;
+}
@@ -0,0 +1,339 @@
+/* identity.c - preload tracking of file changes
+ *
+ * This file is part of preload.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "identity.h"
+
+#include "common.h"
+#include "conf.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+/* what package managers do to a file: rename a new one over it, write it
+ * in place, or delete it */
+#define WATCH_MASK                                              \
+    (IN_MOVED_TO | IN_MOVED_FROM | IN_CLOSE_WRITE | IN_CREATE | \
+     IN_DELETE | IN_DELETE_SELF | IN_ONLYDIR)
+
+typedef enum {
+    ID_SAME,    /* or cannot tell */
+    ID_LEARNED, /* not known before */
+    ID_CHANGED, /* another file now */
+    ID_GONE     /* no file anymore */
+} id_result_t;
+
+static int inotify_fd = -1; /* -2 if not available */
+static GHashTable* watches; /* wd -> directory */
+static GHashTable* watched; /* directory -> wd, or -1 if failed */
+static GHashTable* changed; /* paths reported since the last check */
+static gboolean overflowed; /* events were lost, check everything */
+
+typedef struct _check_context_t {
+    int quota;         /* of checks due to the sweep, left this cycle */
+    GHashTable* stale; /* maps changed or gone */
+    int count;         /* of maps and exes found changed or gone */
+} check_context_t;
+
+static void watch_open(void) {
+#ifdef HAVE_SYS_INOTIFY_H
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        g_message("cannot watch directories for changes: %s, checking "
+                  "files every %ds only",
+                  strerror(errno), conf->system.filecheck);
+        inotify_fd = -2;
+        return;
+    }
+    watches = g_hash_table_new(g_direct_hash, g_direct_equal);
+    watched = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    changed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+#else
+    inotify_fd = -2;
+#endif
+}
+
+/* watches the directory of path, unless done already */
+static void watch_dir_of(const char* path) {
+#ifdef HAVE_SYS_INOTIFY_H
+    char* dir;
+    int wd;
+
+    if (inotify_fd < 0)
+        return;
+
+    dir = g_path_get_dirname(path);
+    if (g_hash_table_contains(watched, dir)) {
+        g_free(dir);
+        return;
+    }
+
+    /* out of watches, most likely.  the sweep covers it */
+    wd = inotify_add_watch(inotify_fd, dir, WATCH_MASK);
+    if (wd >= 0 && g_hash_table_lookup(watches, GINT_TO_POINTER(wd))) {
+        /* another name of a directory watched already */
+        g_hash_table_insert(watched, dir, GINT_TO_POINTER(-1));
+        return;
+    }
+    g_hash_table_insert(watched, dir, GINT_TO_POINTER(wd));
+    if (wd >= 0)
+        g_hash_table_insert(watches, GINT_TO_POINTER(wd), dir);
+#else
+    (void)path;
+#endif
+}
+
+/* collects the paths the watches reported since the last time */
+static void watch_read(void) {
+#ifdef HAVE_SYS_INOTIFY_H
+    char buf[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    if (inotify_fd < 0)
+        return;
+
+    while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        char* p;
+
+        for (p = buf; p < buf + len;) {
+            struct inotify_event* event = (struct inotify_event*)p;
+            const char* dir =
+                g_hash_table_lookup(watches, GINT_TO_POINTER(event->wd));
+
+            p += sizeof(*event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflowed = TRUE;
+            } else if (event->mask & IN_IGNORED) {
+                /* the directory went away, watch it again if it is back */
+                if (dir) {
+                    g_hash_table_remove(watches, GINT_TO_POINTER(event->wd));
+                    g_hash_table_remove(watched, dir);
+                }
+            } else if (dir && event->len) {
+                g_hash_table_add(changed,
+                                 g_build_filename(dir, event->name, NULL));
+            }
+        }
+    }
+#endif
+}
+
+static id_result_t identity_check(const char* path, preload_identity_t* id) {
+    struct stat buf;
+    preload_identity_t now;
+
+    if (0 > stat(path, &buf)) {
+        /* never seen, as in synthetic models, or not for us to see */
+        if (!id->ino || (errno != ENOENT && errno != ENOTDIR))
+            return ID_SAME;
+        memset(id, 0, sizeof(*id));
+        return ID_GONE;
+    }
+
+    now.dev = buf.st_dev;
+    now.ino = buf.st_ino;
+    now.size = buf.st_size;
+    now.mtime = buf.st_mtim.tv_sec * (gint64)1000000000 + buf.st_mtim.tv_nsec;
+    if (!id->ino) {
+        *id = now;
+        return ID_LEARNED;
+    }
+    if (now.dev == id->dev && now.ino == id->ino && now.size == id->size &&
+        now.mtime == id->mtime)
+        return ID_SAME;
+    *id = now;
+    return ID_CHANGED;
+}
+
+/* whether to check the file of path, last checked at check_time */
+static gboolean is_due(const char* path,
+                       int check_time,
+                       check_context_t* ctx) {
+    if (check_time < 0 || overflowed)
+        return TRUE;
+    if (changed && g_hash_table_contains(changed, path))
+        return TRUE;
+    if (ctx->quota > 0 &&
+        state->time - check_time >= conf->system.filecheck) {
+        ctx->quota--;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static void map_check(preload_map_t* map, check_context_t* ctx) {
+    preload_identity_t old = map->id;
+    id_result_t result;
+
+    if (!is_due(map->path, map->check_time, ctx))
+        return;
+
+    map->check_time = state->time;
+    result = identity_check(map->path, &map->id);
+    if (result == ID_CHANGED || result == ID_GONE) {
+        preload_state_forget_path(old.dev, old.ino, map->path);
+        g_debug("map %s %s, dropping it", map->path,
+                result == ID_GONE ? "gone" : "changed");
+        g_hash_table_add(ctx->stale, map);
+        ctx->count++;
+    }
+    if (result == ID_LEARNED)
+        preload_state_map_path(map->id.dev, map->id.ino, map->path);
+    if (result != ID_GONE)
+        watch_dir_of(map->path);
+}
+
+static void exe_drop_exemaps(preload_exe_t* exe) {
+    g_set_foreach(exe->exemaps, (GFunc)G_CALLBACK(preload_exemap_free), NULL);
+    g_set_free(exe->exemaps);
+    exe->exemaps = g_set_new();
+    exe->size = 0;
+    exe->reprobe = TRUE;
+}
+
+static void exe_check(gpointer G_GNUC_UNUSED key,
+                      preload_exe_t* exe,
+                      check_context_t* ctx) {
+    id_result_t result;
+
+    if (!is_due(exe->path, exe->check_time, ctx))
+        return;
+
+    exe->check_time = state->time;
+    result = identity_check(exe->path, &exe->id);
+    if (result == ID_CHANGED || result == ID_GONE) {
+        g_debug("exe %s %s, to learn its maps again", exe->path,
+                result == ID_GONE ? "gone" : "changed");
+        exe_drop_exemaps(exe);
+        ctx->count++;
+    }
+    if (result != ID_GONE)
+        watch_dir_of(exe->path);
+}
+
+/* forgets the bad exe if its file changed or went away, to be looked at
+ * again from its next process */
+static gboolean badexe_check(const char* path,
+                             preload_badexe_t* badexe,
+                             check_context_t* ctx) {
+    id_result_t result;
+
+    if (!is_due(path, badexe->check_time, ctx))
+        return FALSE;
+
+    badexe->check_time = state->time;
+    result = identity_check(path, &badexe->id);
+    if (result != ID_GONE)
+        watch_dir_of(path);
+    if (result == ID_CHANGED || result == ID_GONE) {
+        g_debug("bad exe %s %s, forgetting it", path,
+                result == ID_GONE ? "gone" : "changed");
+        ctx->count++;
+        return TRUE;
+    }
+    if (result == ID_LEARNED)
+        state->dirty = TRUE;
+    return FALSE;
+}
+
+typedef struct _drop_context_t {
+    GHashTable* stale;
+    GSList* drop; /* of exemaps */
+} drop_context_t;
+
+static void exemap_if_stale(preload_exemap_t* exemap, drop_context_t* ctx) {
+    if (g_hash_table_contains(ctx->stale, exemap->map))
+        ctx->drop = g_slist_prepend(ctx->drop, exemap);
+}
+
+/* drops the exemaps of exe whose maps are stale */
+static void exe_drop_stale(gpointer G_GNUC_UNUSED key,
+                           preload_exe_t* exe,
+                           GHashTable* stale) {
+    drop_context_t ctx = {stale, NULL};
+    GSList* l;
+
+    g_set_foreach(exe->exemaps, (GFunc)G_CALLBACK(exemap_if_stale), &ctx);
+    for (l = ctx.drop; l; l = l->next) {
+        preload_exemap_t* exemap = l->data;
+
+        exe->size -= preload_map_get_size(exemap->map);
+        g_set_remove(exe->exemaps, exemap);
+        preload_exemap_free(exemap);
+        exe->reprobe = TRUE;
+    }
+    g_slist_free(ctx.drop);
+}
+
+void preload_identity_check(void) {
+    check_context_t ctx;
+    int total;
+
+    if (preload_trace_replaying() || conf->system.filecheck <= 0)
+        return;
+
+    if (inotify_fd == -1)
+        watch_open();
+    watch_read();
+
+    /* enough for the sweep to get around in filecheck seconds */
+    total = state->maps_arr->len + g_hash_table_size(state->exes) +
+            g_hash_table_size(state->bad_exes);
+    ctx.quota = (gint64)total * conf->model.cycle / conf->system.filecheck + 1;
+    ctx.stale = g_hash_table_new(g_direct_hash, g_direct_equal);
+    ctx.count = 0;
+
+    g_ptr_array_foreach(state->maps_arr, (GFunc)G_CALLBACK(map_check), &ctx);
+    g_hash_table_foreach(state->exes, (GHFunc)G_CALLBACK(exe_check), &ctx);
+    g_hash_table_foreach_remove(state->bad_exes,
+                                (GHRFunc)G_CALLBACK(badexe_check), &ctx);
+
+    /* unreferences them, freeing those no exe uses anymore */
+    if (g_hash_table_size(ctx.stale))
+        g_hash_table_foreach(state->exes, (GHFunc)G_CALLBACK(exe_drop_stale),
+                             ctx.stale);
+    g_hash_table_destroy(ctx.stale);
+
+    if (ctx.count) {
+        g_message("%d maps and exes changed on disk, to be learned again",
+                  ctx.count);
+        preload_metrics_count(METRIC_STALE_FILES, ctx.count);
+        state->dirty = TRUE;
+    }
+
+    overflowed = FALSE;
+    if (changed)
+        g_hash_table_remove_all(changed);
+}
+
+void preload_identity_free(void) {
+    if (inotify_fd >= 0) {
+        close(inotify_fd);
+        g_hash_table_destroy(watches);
+        g_hash_table_destroy(watched);
+        g_hash_table_destroy(changed);
+        watches = watched = changed = NULL;
+    }
+    inotify_fd = -1;
+    overflowed = FALSE;
+}
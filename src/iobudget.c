@@ -0,0 +1,215 @@
+/* iobudget.c - preload readahead I/O budget
+ *
+ * This file is part of preload.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "iobudget.h"
+
+#include <sys/syscall.h>
+#ifdef HAVE_LINUX_IOPRIO_H
+#include <linux/ioprio.h>
+#endif
+
+#include "common.h"
+#include "conf.h"
+#include "log.h"
+#include "metrics.h"
+#include "pressure.h"
+
+#define SYSBLOCK "/sys/block"
+
+/* how often to look at the disks, at most, in microseconds */
+#define CHECK_US 1000000
+
+/* the rate is halved every check the disks are busy, down to this, and
+ * grows back by an eighth of the configured rate every check they are
+ * not */
+#define MIN_FACTOR (1. / 64)
+#define FACTOR_STEP (1. / 8)
+
+static struct {
+    gboolean started;
+    double bytes_left; /* tokens */
+    double requests_left;
+    double factor;   /* of the configured rates in effect */
+    gboolean busy;   /* as of the last check */
+    gint64 refilled; /* monotonic microseconds */
+    gint64 checked;
+    GHashTable* ticks; /* device name -> milliseconds busy, as last read */
+} bucket;
+
+/* the largest share of the time since the last call, in percent, any
+ * block device was busy.  devices backed by memory or by files are not
+ * interesting, the I/O of loop devices shows up on the one below */
+static double devices_util(double elapsed_ms) {
+    GDir* dir;
+    const char* name;
+    double util = 0;
+
+    if (!bucket.ticks)
+        bucket.ticks =
+            g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    dir = g_dir_open(SYSBLOCK, 0, NULL);
+    if (!dir)
+        return 0;
+
+    while ((name = g_dir_read_name(dir))) {
+        char path[FILELEN];
+        char* contents = NULL;
+        unsigned long ticks;
+        gpointer old;
+
+        if (g_str_has_prefix(name, "loop") || g_str_has_prefix(name, "ram") ||
+            g_str_has_prefix(name, "zram"))
+            continue;
+
+        g_snprintf(path, sizeof(path), "%s/%s/stat", SYSBLOCK, name);
+        /* io_ticks is the tenth field */
+        if (!g_file_get_contents(path, &contents, NULL, NULL) ||
+            1 != sscanf(contents, "%*u %*u %*u %*u %*u %*u %*u %*u %*u %lu",
+                        &ticks)) {
+            g_free(contents);
+            continue;
+        }
+        g_free(contents);
+
+        if (g_hash_table_lookup_extended(bucket.ticks, name, NULL, &old) &&
+            elapsed_ms > 0)
+            util = MAX(util, 100. * (ticks - GPOINTER_TO_SIZE(old)) /
+                                 elapsed_ms);
+        g_hash_table_insert(bucket.ticks, g_strdup(name),
+                            GSIZE_TO_POINTER(ticks));
+    }
+
+    g_dir_close(dir);
+    return util;
+}
+
+static void check_busy(gint64 now) {
+    double elapsed_ms = (now - bucket.checked) / 1000.;
+    double io = -1, util = 0;
+
+    if (bucket.checked && now - bucket.checked < CHECK_US)
+        return;
+
+    if (conf->system.iopressure > 0)
+        io = preload_pressure_avg10("io");
+    if (conf->system.ioutil > 0)
+        util = devices_util(bucket.checked ? elapsed_ms : 0);
+    bucket.checked = now;
+
+    bucket.busy = (conf->system.iopressure > 0 &&
+                   io >= conf->system.iopressure) ||
+                  (conf->system.ioutil > 0 && util >= conf->system.ioutil);
+    if (bucket.busy) {
+        g_debug("disks busy (io pressure %.1lf%%, utilization %.0lf%%), "
+                "backing off",
+                io, util);
+        bucket.factor = MAX(MIN_FACTOR, bucket.factor / 2);
+    } else {
+        bucket.factor = MIN(1, bucket.factor + FACTOR_STEP);
+    }
+}
+
+/* a cycle's worth of tokens, or 0 if unlimited */
+static double capacity(int rate) {
+    return rate > 0 ? (double)rate * conf->model.cycle : 0;
+}
+
+/* adds the tokens for the time passed, up to a cycle's worth.  a bucket
+ * made unlimited forgets its debt */
+static void refill(double* tokens, int rate, double elapsed) {
+    double cap = capacity(rate);
+
+    *tokens = CLAMP(*tokens + MAX(rate, 0) * bucket.factor * elapsed, -cap,
+                    cap);
+}
+
+/* takes amount from a limited bucket.  the debt is bounded by a cycle's
+ * worth, so that a huge map does not hold the next ones back for long */
+static void charge(double* tokens, int rate, double amount) {
+    if (rate > 0)
+        *tokens = MAX(-capacity(rate), *tokens - amount);
+}
+
+int preload_iobudget_take(preload_map_t** files, int file_count) {
+    gint64 now = g_get_monotonic_time();
+    int i;
+
+    if (!bucket.started) {
+        bucket.started = TRUE;
+        bucket.factor = 1;
+        bucket.bytes_left = capacity(conf->system.iorate);
+        bucket.requests_left = capacity(conf->system.iops);
+    } else {
+        refill(&bucket.bytes_left, conf->system.iorate,
+               (now - bucket.refilled) / 1e6);
+        refill(&bucket.requests_left, conf->system.iops,
+               (now - bucket.refilled) / 1e6);
+    }
+    bucket.refilled = now;
+
+    check_busy(now);
+    if (bucket.busy)
+        return 0;
+
+    /* the last map taken may overdraw the bucket, for maps larger than
+     * it to get their turn too; the debt is paid by waiting longer */
+    for (i = 0; i < file_count; i++) {
+        if (conf->system.iorate > 0 && bucket.bytes_left <= 0)
+            break;
+        if (conf->system.iops > 0 && bucket.requests_left <= 0)
+            break;
+        charge(&bucket.bytes_left, conf->system.iorate, files[i]->length);
+        charge(&bucket.requests_left, conf->system.iops, 1);
+    }
+
+    return i;
+}
+
+#if defined(HAVE_LINUX_IOPRIO_H) && defined(SYS_ioprio_set)
+
+int preload_iobudget_idle(void) {
+    int old;
+
+    if (!conf->system.ioidle)
+        return -1;
+
+    old = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+    if (old < 0 ||
+        0 > syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                    IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)))
+        return -1;
+    return old;
+}
+
+void preload_iobudget_restore(int ioprio) {
+    if (ioprio >= 0)
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio);
+}
+
+#else
+
+int preload_iobudget_idle(void) {
+    return -1;
+}
+
+void preload_iobudget_restore(int G_GNUC_UNUSED ioprio) {}
+
+#endif
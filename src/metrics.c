@@ -0,0 +1,205 @@
+/* metrics.c - preload counters, gauges and phase timings
+ *
+ * This file is part of preload.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "metrics.h"
+
+#include <glib/gstdio.h>
+
+#include "common.h"
+#include "log.h"
+
+static const char* phase_names[METRIC_PHASES] = {
+    "scan", "update", "predict", "readahead", "save",
+};
+
+static const struct {
+    const char* name;
+    const char* help;
+} counters[METRIC_COUNTERS] = {
+    {"preload_processes_scanned_total", "Processes looked at in scans."},
+    {"preload_maps_read_total", "Maps of processes read."},
+    {"preload_maps_aliased_total",
+     "Maps of processes of a file known by another path."},
+    {"preload_foreign_unresolved_total",
+     "Maps and exes of processes of other mount namespaces not found here."},
+    {"preload_readahead_bytes_total", "Bytes asked to be read in."},
+    {"preload_readahead_maps_total", "Maps asked to be read in."},
+    {"preload_readahead_ranges_total", "Ranges read in, after merging."},
+    {"preload_readahead_runs_total",
+     "Runs of ranges next to each other on disk, each read by one reader."},
+    {"preload_readahead_merged_total",
+     "Ranges merged into the previous one."},
+    {"preload_readahead_forks_total", "Reader processes forked."},
+    {"preload_readahead_cancelled_total",
+     "Ranges not read in because of memory pressure."},
+    {"preload_readahead_throttled_total",
+     "Maps left out of readahead by the I/O budget."},
+    {"preload_fdcache_hits_total", "Files to read found open already."},
+    {"preload_fdcache_opens_total", "Files opened to read, and kept open."},
+    {"preload_stale_files_total",
+     "Files of maps and exes found changed or gone, and learned again."},
+    {"preload_bad_exe_hits_total",
+     "Processes scanned of exes known to be too small."},
+    {"preload_maps_reads_avoided_total",
+     "Reads of the maps of exes known to be too small saved, one per exe "
+     "per scan."},
+    {"preload_prefetch_maps_total", "Maps read in ahead of their use."},
+    {"preload_prefetch_hits_total",
+     "Maps read in ahead that were used while still cached."},
+    {"preload_prefetch_evicted_total",
+     "Maps read in ahead that were evicted before a use."},
+    {"preload_prefetch_wasted_total",
+     "Maps read in ahead that were not used in time."},
+}, gauges[METRIC_GAUGES] = {
+    {"preload_memavail_bytes", "Memory allowed for prefetching."},
+    {"preload_memused_bytes", "Memory selected for prefetching."},
+    {"preload_exes", "Exes known."},
+    {"preload_bad_exes", "Exes ignored for being too small."},
+    {"preload_maps", "Maps known."},
+    {"preload_running_exes", "Exes running."},
+    {"preload_prefetch_pending_maps",
+     "Maps read in ahead, waiting for a use."},
+    {"preload_queue_chunks", "Chunks queued for prefetching, not read yet."},
+};
+
+/* upper bounds of the histogram buckets, in seconds, +Inf implied */
+static const double buckets[] = {0.0001, 0.0005, 0.001, 0.005, 0.01,
+                                 0.05,   0.1,    0.5,   1,     5};
+#define BUCKETS G_N_ELEMENTS(buckets)
+
+typedef struct _histogram_t {
+    guint64 counts[BUCKETS + 1]; /* per bucket, not cumulative */
+    guint64 count;
+    double sum;
+    gint64 start; /* of the phase running, in microseconds */
+} histogram_t;
+
+static histogram_t phases[METRIC_PHASES];
+static guint64 counter_values[METRIC_COUNTERS];
+static double gauge_values[METRIC_GAUGES];
+static char* metrics_file;
+
+void preload_metrics_begin(preload_metric_phase_t phase) {
+    phases[phase].start = g_get_monotonic_time();
+}
+
+void preload_metrics_end(preload_metric_phase_t phase) {
+    histogram_t* h = &phases[phase];
+    double seconds = (g_get_monotonic_time() - h->start) / 1e6;
+    guint i;
+
+    for (i = 0; i < BUCKETS && seconds > buckets[i]; i++)
+        ;
+    h->counts[i]++;
+    h->count++;
+    h->sum += seconds;
+}
+
+void preload_metrics_count(preload_metric_counter_t counter, guint64 n) {
+    counter_values[counter] += n;
+}
+
+void preload_metrics_set(preload_metric_gauge_t gauge, double value) {
+    gauge_values[gauge] = value;
+}
+
+gboolean preload_metrics_open(const char* metricsfile) {
+    g_free(metrics_file);
+    metrics_file = g_strdup(metricsfile);
+    g_message("writing metrics to %s", metricsfile);
+
+    /* find out early if it cannot be written */
+    preload_metrics_write();
+    return metrics_file != NULL;
+}
+
+void preload_metrics_close(void) {
+    g_free(metrics_file);
+    metrics_file = NULL;
+}
+
+static void write_histograms(FILE* f) {
+    int p;
+
+    fprintf(f,
+            "# HELP preload_phase_seconds Time spent in each phase of a "
+            "cycle.\n"
+            "# TYPE preload_phase_seconds histogram\n");
+    for (p = 0; p < METRIC_PHASES; p++) {
+        histogram_t* h = &phases[p];
+        guint64 cumulative = 0;
+        guint i;
+
+        for (i = 0; i < BUCKETS; i++) {
+            cumulative += h->counts[i];
+            fprintf(f,
+                    "preload_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} "
+                    "%" G_GUINT64_FORMAT "\n",
+                    phase_names[p], buckets[i], cumulative);
+        }
+        fprintf(f,
+                "preload_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} "
+                "%" G_GUINT64_FORMAT "\n",
+                phase_names[p], h->count);
+        fprintf(f, "preload_phase_seconds_sum{phase=\"%s\"} %.6f\n",
+                phase_names[p], h->sum);
+        fprintf(f,
+                "preload_phase_seconds_count{phase=\"%s\"} "
+                "%" G_GUINT64_FORMAT "\n",
+                phase_names[p], h->count);
+    }
+}
+
+void preload_metrics_write(void) {
+    char* tmpfile;
+    FILE* f;
+    int i;
+
+    if (!metrics_file)
+        return;
+
+    /* scrapers must never see a half written file */
+    tmpfile = g_strconcat(metrics_file, ".tmp", NULL);
+    f = fopen(tmpfile, "w");
+    if (!f) {
+        g_warning("cannot open %s for writing, stopping metrics: %s", tmpfile,
+                  strerror(errno));
+        g_free(tmpfile);
+        preload_metrics_close();
+        return;
+    }
+
+    write_histograms(f);
+    for (i = 0; i < METRIC_COUNTERS; i++)
+        fprintf(f,
+                "# HELP %s %s\n# TYPE %s counter\n%s %" G_GUINT64_FORMAT "\n",
+                counters[i].name, counters[i].help, counters[i].name,
+                counters[i].name, counter_values[i]);
+    for (i = 0; i < METRIC_GAUGES; i++)
+        fprintf(f, "# HELP %s %s\n# TYPE %s gauge\n%s %.0f\n", gauges[i].name,
+                gauges[i].help, gauges[i].name, gauges[i].name,
+                gauge_values[i]);
+
+    if (fclose(f) || 0 > g_rename(tmpfile, metrics_file)) {
+        g_warning("failed writing %s: %s", metrics_file, strerror(errno));
+        g_unlink(tmpfile);
+    }
+    g_free(tmpfile);
+}
@@ -0,0 +1,403 @@
+/* mntns.c - preload paths of files of other mount namespaces
+ *
+ * This file is part of preload.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "mntns.h"
+
+#include <sys/sysmacros.h>
+
+#include "log.h"
+#include "proc.h"
+
+/* files found, or not, kept at most */
+#define CACHE_MAX 16384
+/* how old our own mounts may be when looked at, in microseconds */
+#define HOST_MOUNTS_US (60 * G_USEC_PER_SEC)
+/* and those of the process looked at last */
+#define PID_MOUNTS_US G_USEC_PER_SEC
+
+typedef struct _mount_t {
+    dev_t dev;
+    char* root;    /* of the filesystem, mounted at point */
+    char* point;
+    char** layers; /* of an overlay, upper first, or NULL */
+} mount_t;
+
+typedef struct _file_key_t {
+    guint64 ns;
+    guint64 dev;
+    guint64 ino;
+} file_key_t;
+
+typedef struct _file_t {
+    file_key_t key;
+    char* path; /* ours, or NULL if not found */
+    dev_t dev;
+    ino_t ino;
+} file_t;
+
+static guint64 own_ns; /* G_MAXUINT64 if cannot be told */
+static GHashTable* files; /* file_key_t -> file_t */
+
+static GPtrArray* host_mounts;
+static gint64 host_time;
+static GPtrArray* pid_mounts;
+static pid_t pid_mounts_pid;
+static gint64 pid_time;
+
+static guint64 ns_of(const char* pid) {
+    char name[FILELEN];
+    struct stat buf;
+
+    g_snprintf(name, sizeof(name), "%s/%s/ns/mnt", proc_get_root(), pid);
+    if (0 > stat(name, &buf))
+        return 0;
+    return buf.st_ino;
+}
+
+guint64 preload_mntns_own(void) {
+    if (!own_ns) {
+        own_ns = ns_of("self");
+        if (!own_ns)
+            own_ns = G_MAXUINT64;
+    }
+    return own_ns == G_MAXUINT64 ? 0 : own_ns;
+}
+
+guint64 preload_mntns_of(pid_t pid) {
+    char name[16];
+    guint64 ns;
+
+    if (!preload_mntns_own())
+        return 0;
+
+    g_snprintf(name, sizeof(name), "%d", pid);
+    ns = ns_of(name);
+    return ns == own_ns ? 0 : ns;
+}
+
+static void file_free(file_t* file) {
+    g_free(file->path);
+    g_free(file);
+}
+
+static guint file_key_hash(const file_key_t* key) {
+    return (guint)(key->ns ^ (key->dev << 20) ^ key->ino ^ (key->ino >> 32));
+}
+
+static gboolean file_key_equal(const file_key_t* a, const file_key_t* b) {
+    return a->ns == b->ns && a->dev == b->dev && a->ino == b->ino;
+}
+
+/* mountinfo escapes space, tab, newline and backslash as \ooo */
+static void unescape(char* s) {
+    char* d = s;
+
+    while (*s) {
+        if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' && s[2] >= '0' &&
+            s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+            *d++ = (s[1] - '0') << 6 | (s[2] - '0') << 3 | (s[3] - '0');
+            s += 4;
+        } else {
+            *d++ = *s++;
+        }
+    }
+    *d = '\0';
+}
+
+static void mount_free(mount_t* mount) {
+    g_free(mount->root);
+    g_free(mount->point);
+    g_strfreev(mount->layers);
+    g_free(mount);
+}
+
+/* the directories of an overlay, from its mount options: upperdir, then
+ * lowerdir, a list separated by colons, or lowerdir+ once per layer.
+ * data only layers, after a double colon or as datadir+, have no paths
+ * of their own */
+static char** overlay_layers(const char* options) {
+    GPtrArray* layers = g_ptr_array_new();
+    char* upper = NULL;
+    char** opts = g_strsplit(options, ",", 0);
+    char** opt;
+
+    for (opt = opts; *opt; opt++) {
+        unescape(*opt);
+        if (g_str_has_prefix(*opt, "upperdir=")) {
+            g_free(upper);
+            upper = g_strdup(*opt + strlen("upperdir="));
+        } else if (g_str_has_prefix(*opt, "lowerdir+=")) {
+            g_ptr_array_add(layers, g_strdup(*opt + strlen("lowerdir+=")));
+        } else if (g_str_has_prefix(*opt, "lowerdir=")) {
+            char** dirs = g_strsplit(*opt + strlen("lowerdir="), ":", 0);
+            char** dir;
+
+            for (dir = dirs; *dir && **dir; dir++)
+                g_ptr_array_add(layers, g_strdup(*dir));
+            g_strfreev(dirs);
+        }
+    }
+    g_strfreev(opts);
+
+    if (upper)
+        g_ptr_array_insert(layers, 0, upper);
+    g_ptr_array_add(layers, NULL);
+    return (char**)g_ptr_array_free(layers, FALSE);
+}
+
+/* reads /proc/PID/mountinfo, lines of
+ * "id parent major:minor root point options [optional...] - type source
+ * superoptions" */
+static GPtrArray* read_mounts(const char* pid) {
+    GPtrArray* mounts;
+    char name[FILELEN];
+    char buffer[4096];
+    FILE* in;
+
+    g_snprintf(name, sizeof(name), "%s/%s/mountinfo", proc_get_root(), pid);
+    in = fopen(name, "r");
+    if (!in)
+        return NULL;
+
+    mounts = g_ptr_array_new_with_free_func((GDestroyNotify)mount_free);
+    while (fgets(buffer, sizeof(buffer), in)) {
+        char** fields;
+        unsigned int major, minor;
+        int n, sep;
+
+        g_strchomp(buffer);
+        fields = g_strsplit(buffer, " ", 0);
+        n = g_strv_length(fields);
+        for (sep = 6; sep < n && strcmp(fields[sep], "-"); sep++)
+            ;
+        if (sep + 3 < n &&
+            2 == sscanf(fields[2], "%u:%u", &major, &minor)) {
+            mount_t* mount = g_new0(mount_t, 1);
+
+            mount->dev = makedev(major, minor);
+            mount->root = fields[3];
+            mount->point = fields[4];
+            fields[3] = g_strdup("");
+            fields[4] = g_strdup("");
+            unescape(mount->root);
+            unescape(mount->point);
+            if (!strcmp(fields[sep + 1], "overlay"))
+                mount->layers = overlay_layers(fields[sep + 3]);
+            g_ptr_array_add(mounts, mount);
+        }
+        g_strfreev(fields);
+    }
+    fclose(in);
+    return mounts;
+}
+
+/* the rest of path, if it is under dir */
+static const char* under(const char* path, const char* dir) {
+    size_t len = strlen(dir);
+
+    if (len == 1 && *dir == '/')
+        return path + 1;
+    if (strncmp(path, dir, len) || (path[len] && path[len] != '/'))
+        return NULL;
+    return path[len] ? path + len + 1 : path + len;
+}
+
+/* the mount path is on: the last of those mounted over the longest prefix
+ * of it, and the rest of path, relative to the root of the filesystem */
+static mount_t* mount_of(GPtrArray* mounts, const char* path, char** rest) {
+    mount_t* found = NULL;
+    const char* found_rel = NULL;
+    guint i;
+
+    for (i = 0; i < mounts->len; i++) {
+        mount_t* mount = g_ptr_array_index(mounts, i);
+        const char* rel = under(path, mount->point);
+
+        if (rel && (!found || strlen(mount->point) >= strlen(found->point))) {
+            found = mount;
+            found_rel = rel;
+        }
+    }
+    if (found)
+        *rest = g_build_filename(found->root, found_rel, NULL);
+    return found;
+}
+
+/* an overlay shows the file of its topmost layer having it; if that is a
+ * whiteout, the file is gone.  the overlay has devices and possibly
+ * inodes of its own, so it is told by size and modification time */
+static char* find_in_layers(mount_t* mount,
+                            const char* rest,
+                            const struct stat* want,
+                            struct stat* buf) {
+    char** layer;
+
+    for (layer = mount->layers; *layer; layer++) {
+        char* path = g_build_filename(*layer, rest, NULL);
+
+        if (0 == stat(path, buf)) {
+            if (S_ISREG(buf->st_mode) && buf->st_size == want->st_size &&
+                buf->st_mtim.tv_sec == want->st_mtim.tv_sec &&
+                buf->st_mtim.tv_nsec == want->st_mtim.tv_nsec)
+                return path;
+            g_free(path);
+            return NULL;
+        }
+        g_free(path);
+    }
+    return NULL;
+}
+
+/* anything else is the same filesystem, mounted somewhere here too,
+ * hopefully at a root above the file */
+static char* find_in_host(mount_t* mount,
+                          const char* rest,
+                          const struct stat* want,
+                          struct stat* buf) {
+    gint64 now = g_get_monotonic_time();
+    guint i;
+
+    if (!host_mounts || now - host_time >= HOST_MOUNTS_US) {
+        if (host_mounts)
+            g_ptr_array_free(host_mounts, TRUE);
+        host_mounts = read_mounts("self");
+        host_time = now;
+        if (!host_mounts)
+            return NULL;
+    }
+
+    for (i = 0; i < host_mounts->len; i++) {
+        mount_t* host = g_ptr_array_index(host_mounts, i);
+        const char* rel;
+        char* path;
+
+        if (host->dev != mount->dev || !(rel = under(rest, host->root)))
+            continue;
+        path = g_build_filename(host->point, rel, NULL);
+        if (0 == stat(path, buf) && buf->st_dev == want->st_dev &&
+            buf->st_ino == want->st_ino)
+            return path;
+        g_free(path);
+    }
+    return NULL;
+}
+
+/* sets gone if the process could not be looked at, to try another time */
+static char* find(pid_t pid,
+                  const char* path,
+                  struct stat* buf,
+                  gboolean* gone) {
+    gint64 now = g_get_monotonic_time();
+    char name[FILELEN];
+    struct stat want;
+    mount_t* mount;
+    char* rest;
+    char* found;
+
+    /* what the process sees */
+    *gone = TRUE;
+    g_snprintf(name, sizeof(name), "%s/%d/root%s", proc_get_root(), pid, path);
+    if (0 > stat(name, &want))
+        return NULL;
+
+    if (!pid_mounts || pid != pid_mounts_pid ||
+        now - pid_time >= PID_MOUNTS_US) {
+        if (pid_mounts)
+            g_ptr_array_free(pid_mounts, TRUE);
+        g_snprintf(name, sizeof(name), "%d", pid);
+        pid_mounts = read_mounts(name);
+        pid_mounts_pid = pid;
+        pid_time = now;
+        if (!pid_mounts)
+            return NULL;
+    }
+    *gone = FALSE;
+
+    mount = mount_of(pid_mounts, path, &rest);
+    if (!mount)
+        return NULL;
+    if (mount->layers)
+        found = find_in_layers(mount, rest, &want, buf);
+    else
+        found = find_in_host(mount, rest, &want, buf);
+    g_free(rest);
+    return found;
+}
+
+const char* preload_mntns_resolve(pid_t pid,
+                                  guint64 ns,
+                                  dev_t dev,
+                                  ino_t ino,
+                                  const char* path,
+                                  dev_t* host_dev,
+                                  ino_t* host_ino) {
+    file_key_t key;
+    file_t* file;
+
+    if (!files)
+        files = g_hash_table_new_full((GHashFunc)file_key_hash,
+                                      (GEqualFunc)file_key_equal, NULL,
+                                      (GDestroyNotify)file_free);
+
+    key.ns = ns;
+    key.dev = dev;
+    key.ino = ino;
+    file = g_hash_table_lookup(files, &key);
+    if (!file) {
+        struct stat buf;
+        gboolean gone;
+        char* found = find(pid, path, &buf, &gone);
+
+        if (gone)
+            return NULL;
+
+        /* devices and inodes come back, with other namespaces */
+        if (g_hash_table_size(files) >= CACHE_MAX)
+            g_hash_table_remove_all(files);
+
+        file = g_new0(file_t, 1);
+        file->key = key;
+        file->path = found;
+        if (file->path) {
+            file->dev = buf.st_dev;
+            file->ino = buf.st_ino;
+            g_debug("%s of process %d is %s", path, pid, file->path);
+        }
+        g_hash_table_insert(files, &file->key, file);
+    }
+
+    if (file->path) {
+        *host_dev = file->dev;
+        *host_ino = file->ino;
+    }
+    return file->path;
+}
+
+void preload_mntns_free(void) {
+    if (files)
+        g_hash_table_destroy(files);
+    if (host_mounts)
+        g_ptr_array_free(host_mounts, TRUE);
+    if (pid_mounts)
+        g_ptr_array_free(pid_mounts, TRUE);
+    files = NULL;
+    host_mounts = pid_mounts = NULL;
+    own_ns = 0;
+}
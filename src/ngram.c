@@ -0,0 +1,313 @@
+/* ngram.c - preload launch sequence prediction model
+ *
+ * This file is part of preload.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include <math.h>
+
+#include "common.h"
+#include "conf.h"
+#include "predictor.h"
+#include "state.h"
+
+#define TAG_NGRAM "NGRAM"
+
+/* longest launch sequence learned, and how fast the prediction of the
+ * next launch fades away after the last one, in seconds. */
+#define NGRAM_MAX_ORDER 4
+#define NGRAM_DECAY (5 * minutes)
+
+/* most sequences remembered, the least seen are forgotten past it, and
+ * most launches counted after one, halved past it so that recent habits
+ * win over old ones. */
+#define NGRAM_MAX_CONTEXTS 4096
+#define NGRAM_MAX_TOTAL 256
+
+/* ngram_context_t: a sequence of launched exes, oldest first, and the
+ * number of times each exe was launched right after it. */
+typedef struct _ngram_context_t {
+    int order;
+    preload_exe_t* exes[NGRAM_MAX_ORDER];
+    int total;         /* sum of the counts in next. */
+    GHashTable* next;  /* exe -> number of launches after the sequence. */
+} ngram_context_t;
+
+static GHashTable* contexts;
+
+/* the last launched exes, oldest first. */
+static preload_exe_t* history[NGRAM_MAX_ORDER];
+static int history_len;
+static int last_launch_time;
+
+static guint context_hash(const ngram_context_t* ctx) {
+    guint h = ctx->order;
+    int i;
+
+    for (i = 0; i < ctx->order; i++)
+        h = h * 31 + g_direct_hash(ctx->exes[i]);
+    return h;
+}
+
+static gboolean context_equal(const ngram_context_t* a,
+                              const ngram_context_t* b) {
+    return a->order == b->order &&
+           !memcmp(a->exes, b->exes, a->order * sizeof(a->exes[0]));
+}
+
+static void context_free(ngram_context_t* ctx) {
+    g_hash_table_destroy(ctx->next);
+    g_free(ctx);
+}
+
+static int ngram_order(void) {
+    return CLAMP(conf->model.ngramorder, 1, NGRAM_MAX_ORDER);
+}
+
+/* the context made of the last order launched exes */
+static void history_context(ngram_context_t* key, int order) {
+    key->order = order;
+    memcpy(key->exes, history + history_len - order,
+           order * sizeof(key->exes[0]));
+}
+
+/* halves the counts of ctx, forgetting the exes down to none */
+static void context_halve(ngram_context_t* ctx) {
+    GHashTableIter iter;
+    gpointer count;
+
+    ctx->total = 0;
+    g_hash_table_iter_init(&iter, ctx->next);
+    while (g_hash_table_iter_next(&iter, NULL, &count)) {
+        int half = GPOINTER_TO_INT(count) / 2;
+
+        if (!half) {
+            g_hash_table_iter_remove(&iter);
+            continue;
+        }
+        g_hash_table_iter_replace(&iter, GINT_TO_POINTER(half));
+        ctx->total += half;
+    }
+}
+
+static void add_context(gpointer G_GNUC_UNUSED key,
+                        ngram_context_t* ctx,
+                        GPtrArray* arr) {
+    g_ptr_array_add(arr, ctx);
+}
+
+static int compare_context_total(const ngram_context_t** a,
+                                 const ngram_context_t** b) {
+    return (*a)->total - (*b)->total;
+}
+
+/* makes room for a new sequence, forgetting the quarter seen the least */
+static void contexts_prune(void) {
+    GPtrArray* arr;
+    guint i, drop;
+
+    if (g_hash_table_size(contexts) < NGRAM_MAX_CONTEXTS)
+        return;
+
+    arr = g_ptr_array_sized_new(g_hash_table_size(contexts));
+    g_hash_table_foreach(contexts, (GHFunc)G_CALLBACK(add_context), arr);
+    g_ptr_array_sort(arr, (GCompareFunc)compare_context_total);
+    drop = arr->len - NGRAM_MAX_CONTEXTS * 3 / 4;
+    for (i = 0; i < drop; i++)
+        g_hash_table_remove(contexts, g_ptr_array_index(arr, i));
+    g_ptr_array_free(arr, TRUE);
+}
+
+static void context_count(const ngram_context_t* key,
+                          preload_exe_t* exe,
+                          int count) {
+    ngram_context_t* ctx;
+    int old;
+
+    ctx = g_hash_table_lookup(contexts, key);
+    if (!ctx) {
+        contexts_prune();
+        ctx = g_new0(ngram_context_t, 1);
+        *ctx = *key;
+        ctx->total = 0;
+        ctx->next = g_hash_table_new(g_direct_hash, g_direct_equal);
+        g_hash_table_insert(contexts, ctx, ctx);
+    }
+
+    old = GPOINTER_TO_INT(g_hash_table_lookup(ctx->next, exe));
+    g_hash_table_insert(ctx->next, exe, GINT_TO_POINTER(old + count));
+    ctx->total += count;
+    while (ctx->total > NGRAM_MAX_TOTAL)
+        context_halve(ctx);
+}
+
+static void ngram_init(void) {
+    contexts = g_hash_table_new_full((GHashFunc)context_hash,
+                                     (GEqualFunc)context_equal,
+                                     (GDestroyNotify)context_free, NULL);
+    history_len = 0;
+    last_launch_time = 0;
+}
+
+static void ngram_free(void) {
+    g_hash_table_destroy(contexts);
+    contexts = NULL;
+    history_len = 0;
+}
+
+/* counts exe as following every suffix of the history up to the
+ * configured order, then appends it to the history. */
+static void ngram_exe_changed(preload_exe_t* exe) {
+    ngram_context_t key;
+    int order = ngram_order();
+    int n;
+
+    if (!exe_is_running(exe))
+        return;
+
+    for (n = 1; n <= MIN(order, history_len); n++) {
+        history_context(&key, n);
+        context_count(&key, exe, 1);
+    }
+
+    if (history_len == NGRAM_MAX_ORDER) {
+        memmove(history, history + 1,
+                (NGRAM_MAX_ORDER - 1) * sizeof(history[0]));
+        history_len--;
+    }
+    history[history_len++] = exe;
+    last_launch_time = state->time;
+}
+
+typedef struct _ngram_bid_context_t {
+    double weight;
+    double decay;
+    int total;
+} ngram_bid_context_t;
+
+/* Computes P(Y launches next | last launched exes) and bids in for Y.
+ * Y should not be running.  Counts are smoothed by one unseen launch,
+ * and the prediction fades as time passes without any launch:
+ *
+ *                       count(seq, Y)       -Δt/decay
+ *   P(Y launches) = ----------------- . e
+ *                    total(seq) + 1
+ */
+static void exe_ngram_bid(preload_exe_t* exe,
+                          gpointer count,
+                          const ngram_bid_context_t* ctx) {
+    double p_runs;
+
+    if (exe_is_running(exe))
+        return;
+
+    p_runs = GPOINTER_TO_INT(count) * ctx->decay / (ctx->total + 1);
+    exe->lnprob += ctx->weight * log(1 - p_runs);
+}
+
+/* bids with the longest sequence seen so far, backing off to shorter
+ * ones when the history has never been seen before. */
+static void ngram_bid(double weight) {
+    ngram_context_t key;
+    ngram_context_t* ctx = NULL;
+    ngram_bid_context_t bid;
+    int n;
+
+    for (n = MIN(ngram_order(), history_len); n > 0 && !ctx; n--) {
+        history_context(&key, n);
+        ctx = g_hash_table_lookup(contexts, &key);
+    }
+    if (!ctx)
+        return;
+
+    bid.weight = weight;
+    bid.decay = exp(-(double)(state->time - last_launch_time) / NGRAM_DECAY);
+    bid.total = ctx->total;
+    g_hash_table_foreach(ctx->next, (GHFunc)G_CALLBACK(exe_ngram_bid), &bid);
+}
+
+static const char* ngram_read(const char G_GNUC_UNUSED* tag,
+                              char* line,
+                              GHashTable* exes) {
+    ngram_context_t key;
+    preload_exe_t* exe;
+    int order, i, seq, count, n;
+
+    if (1 > sscanf(line, "%d%n", &order, &n))
+        return "invalid syntax";
+    if (order < 1 || order > NGRAM_MAX_ORDER)
+        return "invalid syntax";
+    line += n;
+
+    key.order = order;
+    for (i = 0; i <= order; i++) {
+        if (1 > sscanf(line, "%d%n", &seq, &n))
+            return "invalid syntax";
+        line += n;
+
+        exe = g_hash_table_lookup(exes, GINT_TO_POINTER(seq));
+        if (!exe)
+            return "invalid index";
+        if (i < order)
+            key.exes[i] = exe;
+    }
+
+    if (1 > sscanf(line, "%d", &count) || count <= 0)
+        return "invalid syntax";
+
+    context_count(&key, exe, count);
+    return NULL;
+}
+
+static void write_next(preload_exe_t* exe, gpointer count, GString* out) {
+    g_string_append_printf(out, "\t%d\t%d\n", exe->seq,
+                           GPOINTER_TO_INT(count));
+}
+
+static void write_context(gpointer G_GNUC_UNUSED key,
+                          const ngram_context_t* ctx,
+                          GString* out) {
+    GHashTableIter iter;
+    gpointer exe, count;
+    int i;
+
+    g_hash_table_iter_init(&iter, ctx->next);
+    while (g_hash_table_iter_next(&iter, &exe, &count)) {
+        g_string_append_printf(out, "%s\t%d", TAG_NGRAM, ctx->order);
+        for (i = 0; i < ctx->order; i++)
+            g_string_append_printf(out, "\t%d", ctx->exes[i]->seq);
+        write_next(exe, count, out);
+    }
+}
+
+static void ngram_write(GString* out) {
+    g_hash_table_foreach(contexts, (GHFunc)G_CALLBACK(write_context), out);
+}
+
+static const char* const ngram_tags[] = {TAG_NGRAM, NULL};
+
+const preload_predictor_t preload_ngram_predictor = {
+    .name = "ngram",
+    .weight = &conf->model.ngram,
+    .init = ngram_init,
+    .free = ngram_free,
+    .exe_changed = ngram_exe_changed,
+    .bid = ngram_bid,
+    .tags = ngram_tags,
+    .read = ngram_read,
+    .write = ngram_write,
+};
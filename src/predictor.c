@@ -0,0 +1,126 @@
+/* predictor.c - preload prediction model registry
+ *
+ * This file is part of preload.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "predictor.h"
+
+#include "common.h"
+#include "conf.h"
+#include "log.h"
+
+static const preload_predictor_t* const predictors[] = {
+    &preload_markov_predictor,
+    &preload_seasonal_predictor,
+    &preload_ngram_predictor,
+    &preload_spawn_predictor,
+    NULL,
+};
+
+void preload_predictors_init(void) {
+    const preload_predictor_t* const* p;
+
+    for (p = predictors; *p; p++) {
+        if ((*p)->init)
+            (*p)->init();
+    }
+}
+
+void preload_predictors_free(void) {
+    const preload_predictor_t* const* p;
+
+    for (p = predictors; *p; p++) {
+        if ((*p)->free)
+            (*p)->free();
+    }
+}
+
+void preload_predictors_exe_changed(preload_exe_t* exe) {
+    const preload_predictor_t* const* p;
+
+    for (p = predictors; *p; p++) {
+        if ((*p)->exe_changed)
+            (*p)->exe_changed(exe);
+    }
+}
+
+void preload_predictors_spawned(const char* path,
+                                const char* parent,
+                                int delay) {
+    const preload_predictor_t* const* p;
+
+    for (p = predictors; *p; p++) {
+        if ((*p)->spawned)
+            (*p)->spawned(path, parent, delay);
+    }
+}
+
+void preload_predictors_tick(int period) {
+    const preload_predictor_t* const* p;
+
+    for (p = predictors; *p; p++) {
+        if ((*p)->tick)
+            (*p)->tick(period);
+    }
+}
+
+void preload_predictors_bid(void) {
+    const preload_predictor_t* const* p;
+
+    for (p = predictors; *p; p++) {
+        int weight = *(*p)->weight;
+
+        if (!(*p)->bid || weight <= 0)
+            continue;
+
+        (*p)->bid(weight / 100.);
+        g_debug("%s model bid in with weight %d%%", (*p)->name, weight);
+    }
+}
+
+gboolean preload_predictors_read(const char* tag,
+                                 char* line,
+                                 GHashTable* exes,
+                                 const char** errmsg) {
+    const preload_predictor_t* const* p;
+
+    for (p = predictors; *p; p++) {
+        const char* const* t;
+
+        if (!(*p)->tags)
+            continue;
+
+        for (t = (*p)->tags; *t; t++) {
+            if (!strcmp(tag, *t)) {
+                *errmsg = (*p)->read(tag, line, exes);
+                return TRUE;
+            }
+        }
+    }
+
+    return FALSE;
+}
+
+void preload_predictors_write(GString* out) {
+    const preload_predictor_t* const* p;
+
+    for (p = predictors; *p; p++) {
+        if ((*p)->write)
+            (*p)->write(out);
+    }
+}
@@ -31,13 +31,20 @@
 #include "common.h"
 #include "conf.h"
 #include "log.h"
+#include "metrics.h"
+#include "pressure.h"
+#include "proc.h"
 #include "state.h"
+#include "trace.h"
 
 /* variables */
 
 const char* conffile = DEFAULT_CONFFILE;
 const char* statefile = DEFAULT_STATEFILE;
 const char* logfile = DEFAULT_LOGFILE;
+const char* tracefile = NULL;
+const char* procroot = DEFAULT_PROCROOT;
+const char* metricsfile = NULL;
 int nicelevel = DEFAULT_NICELEVEL;
 int foreground = 0;
 
@@ -81,6 +88,7 @@ static gboolean sig_handler_sync(gpointer data) {
         case SIGHUP:
             preload_conf_load(conffile, FALSE);
             preload_log_reopen(logfile);
+            preload_pressure_open();
             break;
         case SIGUSR1:
             preload_state_dump_log();
@@ -119,6 +127,7 @@ int main(int argc, char** argv) {
     preload_cmdline_parse(&argc, &argv);
     preload_log_init(logfile);
     preload_conf_load(conffile, TRUE);
+    proc_set_root(procroot);
     set_sig_handlers();
     if (!foreground)
         daemonize();
@@ -126,6 +135,11 @@ int main(int argc, char** argv) {
         g_warning("%s", strerror(errno));
     g_debug("starting up");
     preload_state_load(statefile);
+    if (tracefile && *tracefile)
+        preload_trace_open(tracefile);
+    if (metricsfile && *metricsfile)
+        preload_metrics_open(metricsfile);
+    preload_pressure_open();
 
     /* main loop */
     main_loop = g_main_loop_new(NULL, FALSE);
@@ -133,6 +147,9 @@ int main(int argc, char** argv) {
     g_main_loop_run(main_loop);
 
     /* clean up */
+    preload_trace_close();
+    preload_metrics_close();
+    preload_pressure_close();
     preload_state_save(statefile);
     if (preload_is_debugging())
         preload_state_free();
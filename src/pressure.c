@@ -0,0 +1,162 @@
+/* pressure.c - preload memory pressure watching
+ *
+ * This file is part of preload.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "pressure.h"
+
+#include <glib-unix.h>
+#include <poll.h>
+
+#include "common.h"
+#include "conf.h"
+#include "log.h"
+#include "proc.h"
+#include "trace.h"
+
+/* the kernel only lets unprivileged triggers use multiples of 2s */
+#define WINDOW_US 2000000
+
+/* a trigger fires at most once a window while the stall lasts, so the
+ * pressure is taken to be over after two windows without one */
+#define CLEAR_US (2 * WINDOW_US)
+
+/* without a trigger, how often to read the averages, at most */
+#define POLL_US 1000000
+
+static char* pressure_file;
+static int trigger_fd = -1;
+static guint trigger_watch;
+static gint64 last_stall;  /* when a trigger last fired, in microseconds */
+static gint64 last_poll;   /* when the averages were last read */
+static gboolean poll_high; /* what they said */
+
+static gboolean trigger_fired(gint G_GNUC_UNUSED fd,
+                              GIOCondition condition,
+                              gpointer G_GNUC_UNUSED data) {
+    if (condition & G_IO_ERR) {
+        g_warning("lost the memory pressure trigger, polling %s instead",
+                  pressure_file);
+        close(trigger_fd);
+        trigger_fd = -1;
+        trigger_watch = 0;
+        return FALSE;
+    }
+
+    if (!last_stall || g_get_monotonic_time() - last_stall >= CLEAR_US)
+        g_debug("memory under pressure, holding prefetching back");
+    last_stall = g_get_monotonic_time();
+    return TRUE;
+}
+
+void preload_pressure_open(void) {
+    char trigger[64];
+    int fd;
+
+    preload_pressure_close();
+    if (conf->model.mempressure <= 0)
+        return;
+
+    pressure_file = g_strdup_printf("%s/pressure/memory", proc_get_root());
+    if (0 > access(pressure_file, R_OK)) {
+        g_message("%s not available, not watching memory pressure",
+                  pressure_file);
+        g_free(pressure_file);
+        pressure_file = NULL;
+        return;
+    }
+
+    /* some task stalled for mempressure percent of the window */
+    g_snprintf(trigger, sizeof(trigger), "some %d %d",
+               CLAMP(conf->model.mempressure, 1, 100) * (WINDOW_US / 100),
+               WINDOW_US);
+    fd = open(pressure_file, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd >= 0 && 0 > write(fd, trigger, strlen(trigger) + 1)) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) {
+        g_message("cannot set a trigger on %s, polling it instead: %s",
+                  pressure_file, strerror(errno));
+        return;
+    }
+
+    trigger_fd = fd;
+    trigger_watch = g_unix_fd_add(fd, G_IO_PRI | G_IO_ERR, trigger_fired,
+                                  NULL);
+}
+
+void preload_pressure_close(void) {
+    if (trigger_watch)
+        g_source_remove(trigger_watch);
+    trigger_watch = 0;
+    if (trigger_fd >= 0)
+        close(trigger_fd);
+    trigger_fd = -1;
+    g_free(pressure_file);
+    pressure_file = NULL;
+    last_stall = last_poll = 0;
+    poll_high = FALSE;
+}
+
+double preload_pressure_avg10(const char* resource) {
+    char name[FILELEN];
+    char* contents = NULL;
+    double avg10 = -1;
+
+    if (preload_trace_replaying())
+        return -1;
+
+    g_snprintf(name, sizeof(name), "%s/pressure/%s", proc_get_root(),
+               resource);
+    if (g_file_get_contents(name, &contents, NULL, NULL) &&
+        1 != sscanf(contents, "some avg10=%lf", &avg10))
+        avg10 = -1;
+
+    g_free(contents);
+    return avg10;
+}
+
+gboolean preload_pressure_high(void) {
+    gint64 now;
+
+    /* the pressure of this machine has nothing to do with a trace */
+    if (!pressure_file || preload_trace_replaying())
+        return FALSE;
+
+    now = g_get_monotonic_time();
+
+    if (trigger_fd < 0) {
+        if (now - last_poll >= POLL_US) {
+            poll_high = preload_pressure_avg10("memory") >=
+                        conf->model.mempressure;
+            last_poll = now;
+        }
+        return poll_high;
+    }
+
+    /* in the middle of a batch of readaheads the main loop is not
+     * running, so look at the trigger ourselves */
+    {
+        struct pollfd p = {trigger_fd, POLLPRI, 0};
+        if (0 < poll(&p, 1, 0) && (p.revents & POLLPRI))
+            trigger_fired(trigger_fd, G_IO_PRI, NULL);
+    }
+
+    return last_stall && now - last_stall < CLEAR_US;
+}
@@ -24,12 +24,42 @@
 #include "proc.h"
 
 #include <ctype.h>
-#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 
 #include "common.h"
 #include "conf.h"
 #include "log.h"
+#include "metrics.h"
+#include "mntns.h"
 #include "state.h"
+#include "trace.h"
+
+/* where procfs is.  everything is read relative to it, so that the daemon
+ * can be run against a made up tree */
+static char* proc_root;
+/* and a descriptor of it, for scans to look up processes relative to */
+static int proc_fd = -1;
+
+void proc_set_root(const char* root) {
+    if (proc_fd >= 0) {
+        close(proc_fd);
+        proc_fd = -1;
+    }
+    g_free(proc_root);
+    if (g_path_is_absolute(root)) {
+        proc_root = g_strdup(root);
+    } else {
+        /* we chdir to / when daemonizing */
+        char* cwd = g_get_current_dir();
+        proc_root = g_build_filename(cwd, root, NULL);
+        g_free(cwd);
+    }
+}
+
+const char* proc_get_root(void) {
+    return proc_root ? proc_root : DEFAULT_PROCROOT;
+}
 
 /* now here is the nasty stuff:  ideally we want to ignore/get-rid-of
  * deleted binaries and maps, BUT, preLINK, renames and later deletes
@@ -63,7 +93,7 @@ static gboolean sanitize_file(char* file) {
     return TRUE;
 }
 
-static gboolean accept_file(char* file, char* const* prefix) {
+static gboolean accept_file(const char* file, char* const* prefix) {
     if (prefix)
         for (; *prefix; prefix++) {
             const char* p = *prefix;
@@ -82,65 +112,269 @@ static gboolean accept_file(char* file, char* const* prefix) {
     return TRUE;
 }
 
-size_t proc_get_maps(pid_t pid, GHashTable* maps, GSet** exemaps) {
-    char name[32];
+/* parses a line of /proc/PID/maps, or a map header line of
+ * /proc/PID/smaps, into file and offset.  returns the length of the
+ * map, or 0 if the line doesn't describe an accepted file map.
+ *
+ * file is the path maps of the file go by, which is not necessarily the
+ * one the process sees, see preload_state_map_path.  that of a process
+ * of another mount namespace ns is ours of the file, if found. */
+static size_t parse_map_line(const char* buffer,
+                             pid_t pid,
+                             guint64 ns,
+                             char* file,
+                             size_t* offset) {
+    unsigned long start, end, off, ino;
+    unsigned int dev_major, dev_minor;
+    dev_t dev;
+    const char* path;
+    int count;
+
+    count = sscanf(buffer, "%lx-%lx %*15s %lx %x:%x %lu %" FILELENSTR "s",
+                   &start, &end, &off, &dev_major, &dev_minor, &ino, file);
+
+    if (count != 7 || end <= start || !sanitize_file(file) ||
+        !accept_file(file, conf->system.mapprefix))
+        return 0;
+
+    dev = makedev(dev_major, dev_minor);
+    if (ns) {
+        ino_t host_ino;
+
+        path = preload_mntns_resolve(pid, ns, dev, ino, file, &dev, &host_ino);
+        if (!path) {
+            preload_metrics_count(METRIC_FOREIGN_UNRESOLVED, 1);
+            return 0;
+        }
+        g_strlcpy(file, path, FILELEN);
+        ino = host_ino;
+    }
+
+    path = preload_state_map_path(dev, ino, file);
+    if (path != file) {
+        g_strlcpy(file, path, FILELEN);
+        preload_metrics_count(METRIC_MAPS_ALIASED, 1);
+    }
+
+    *offset = off;
+    return end - start;
+}
+
+typedef struct _proc_map_t {
+    gsize path; /* where in proc_maps_t.paths */
+    size_t offset;
+    size_t length;
+} proc_map_t;
+
+struct _proc_maps_t {
+    GArray* maps;   /* of proc_map_t */
+    GString* paths; /* of the maps, one after the other */
+    size_t size;    /* sum of their lengths */
+};
+
+static proc_maps_t* scratch;
+
+static proc_maps_t* proc_maps_new(void) {
+    proc_maps_t* maps = g_new(proc_maps_t, 1);
+
+    maps->maps = g_array_new(FALSE, FALSE, sizeof(proc_map_t));
+    maps->paths = g_string_new(NULL);
+    maps->size = 0;
+    return maps;
+}
+
+static void proc_maps_free(proc_maps_t* maps) {
+    g_array_free(maps->maps, TRUE);
+    g_string_free(maps->paths, TRUE);
+    g_free(maps);
+}
+
+proc_maps_t* proc_maps_scratch(void) {
+    if (!scratch)
+        scratch = proc_maps_new();
+    return scratch;
+}
+
+void proc_maps_scratch_free(void) {
+    if (scratch)
+        proc_maps_free(scratch);
+    scratch = NULL;
+}
+
+static void add_map(const char* file,
+                    size_t offset,
+                    size_t length,
+                    proc_maps_t* maps) {
+    proc_map_t map;
+
+    map.path = maps->paths->len;
+    map.offset = offset;
+    map.length = length;
+    /* with its nul */
+    g_string_append_len(maps->paths, file, strlen(file) + 1);
+    g_array_append_val(maps->maps, map);
+    maps->size += length;
+    preload_metrics_count(METRIC_MAPS, 1);
+}
+
+/* the trace has what was accepted when recording, the prefixes may
+ * have changed since */
+static void replay_add_map(const char* file,
+                           size_t offset,
+                           size_t length,
+                           proc_maps_t* maps) {
+    if (accept_file(file, conf->system.mapprefix))
+        add_map(file, offset, length, maps);
+}
+
+size_t proc_maps_read(proc_maps_t* maps, pid_t pid) {
+    char name[FILELEN];
     FILE* in;
-    size_t size = 0;
     char buffer[1024];
+    guint64 ns;
 
-    if (exemaps)
-        *exemaps = g_set_new();
+    g_array_set_size(maps->maps, 0);
+    g_string_truncate(maps->paths, 0);
+    maps->size = 0;
+
+    if (preload_trace_replaying()) {
+        preload_trace_replay_maps(
+            pid, FALSE, (preload_trace_map_func_t)G_CALLBACK(replay_add_map),
+            maps);
+        return maps->size;
+    }
 
-    g_snprintf(name, sizeof(name) - 1, "/proc/%d/maps", pid);
+    g_snprintf(name, sizeof(name), "%s/%d/maps", proc_get_root(), pid);
     in = fopen(name, "r");
     if (!in) {
         /* this may fail for a variety of reason.  process terminated
          * for example, or permission denied. */
         return 0;
     }
+    ns = preload_mntns_of(pid);
 
+    preload_trace_maps_begin(pid, FALSE);
     while (fgets(buffer, sizeof(buffer) - 1, in)) {
         char file[FILELEN];
-        long start, end, offset, length;
-        int count;
+        size_t offset, length;
 
-        count =
-            sscanf(buffer, "%ld-%ld %*15s %ld %*x:%*x %*u %" FILELENSTR "s",
-                   &start, &end, &offset, file);
-
-        if (count != 4 || !sanitize_file(file) ||
-            !accept_file(file, conf->system.mapprefix))
+        length = parse_map_line(buffer, pid, ns, file, &offset);
+        if (!length)
             continue;
 
-        length = end - start;
-        size += length;
+        preload_trace_map(file, offset, length);
+        add_map(file, offset, length, maps);
+    }
+    preload_trace_maps_end();
+
+    fclose(in);
 
-        if (maps || exemaps) {
-            gpointer orig_map;
-            preload_map_t* map;
-            gpointer value;
+    return maps->size;
+}
 
-            map = preload_map_new(file, offset, length);
+GSet* proc_maps_exemaps(proc_maps_t* maps, GHashTable* known) {
+    GSet* exemaps = g_set_new();
+    guint i;
+
+    for (i = 0; i < maps->maps->len; i++) {
+        proc_map_t* m = &g_array_index(maps->maps, proc_map_t, i);
+        preload_map_t key;
+        gpointer map;
+
+        key.path = maps->paths->str + m->path;
+        key.offset = m->offset;
+        key.length = m->length;
+        if (!known || !g_hash_table_lookup_extended(known, &key, &map, NULL))
+            map = preload_map_new(key.path, key.offset, key.length);
+        g_set_add(exemaps, preload_exemap_new(map));
+    }
+    return exemaps;
+}
 
-            if (maps) {
-                if (g_hash_table_lookup_extended(maps, map, &orig_map,
-                                                 &value)) {
-                    preload_map_free(map);
-                    map = (preload_map_t*)orig_map;
-                }
-            }
+size_t proc_get_maps(pid_t pid, GHashTable* maps, GSet** exemaps) {
+    size_t size;
+
+    size = proc_maps_read(proc_maps_scratch(), pid);
+    if (exemaps)
+        *exemaps = proc_maps_exemaps(scratch, maps);
+    return size;
+}
+
+static void add_used(const char* file,
+                     size_t offset,
+                     size_t length,
+                     GHashTable* used) {
+    preload_map_t* map = preload_map_new(file, offset, length);
+
+    if (g_hash_table_lookup(used, map))
+        preload_map_free(map);
+    else
+        g_hash_table_insert(used, map, map);
+}
 
-            if (exemaps) {
-                preload_exemap_t* exemap;
-                exemap = preload_exemap_new(map);
-                g_set_add(*exemaps, exemap);
+GHashTable* proc_get_maps_usage(pid_t pid) {
+    char name[FILELEN];
+    FILE* in;
+    char buffer[1024];
+    GHashTable* used;
+    preload_map_t* map = NULL;
+    guint64 ns;
+
+    used = g_hash_table_new_full((GHashFunc)preload_map_hash,
+                                 (GEqualFunc)preload_map_equal,
+                                 (GDestroyNotify)preload_map_free, NULL);
+
+    if (preload_trace_replaying()) {
+        if (!preload_trace_replay_maps(
+                pid, TRUE, (preload_trace_map_func_t)G_CALLBACK(add_used),
+                used)) {
+            g_hash_table_destroy(used);
+            return NULL;
+        }
+        return used;
+    }
+
+    g_snprintf(name, sizeof(name), "%s/%d/smaps", proc_get_root(), pid);
+    in = fopen(name, "r");
+    if (!in) {
+        g_hash_table_destroy(used);
+        return NULL;
+    }
+    ns = preload_mntns_of(pid);
+
+    preload_trace_maps_begin(pid, TRUE);
+
+    while (fgets(buffer, sizeof(buffer) - 1, in)) {
+        char file[FILELEN];
+        size_t offset, length;
+        long rss;
+
+        /* a map header is followed by a number of "Key: value" lines,
+         * Rss being the amount of it that this process has touched. */
+        if (1 == sscanf(buffer, "Rss: %ld", &rss)) {
+            if (map && rss > 0 && !g_hash_table_lookup(used, map)) {
+                preload_trace_map(map->path, map->offset, map->length);
+                g_hash_table_insert(used, map, map);
+                map = NULL;
             }
+            continue;
         }
+
+        length = parse_map_line(buffer, pid, ns, file, &offset);
+        if (!length)
+            continue;
+
+        if (map)
+            preload_map_free(map);
+        map = preload_map_new(file, offset, length);
     }
 
+    if (map)
+        preload_map_free(map);
+    preload_trace_maps_end();
     fclose(in);
 
-    return size;
+    return used;
 }
 
 static gboolean all_digits(const char* s) {
@@ -151,45 +385,167 @@ static gboolean all_digits(const char* s) {
     return TRUE;
 }
 
-void proc_foreach(GHFunc func, gpointer user_data) {
-    DIR* proc;
-    struct dirent* entry;
+/* what getdents64 returns, a struct linux_dirent64 */
+typedef struct _proc_dirent_t {
+    guint64 d_ino;
+    gint64 d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} proc_dirent_t;
+
+typedef struct _scan_entry_t {
+    pid_t pid;
+    char* exe;         /* as the process sees it, or NULL if not to be
+                          looked at */
+    gboolean accepted; /* by exeprefix */
+    guint64 ns;        /* its mount namespace, if not ours and accepted */
+    dev_t dev;         /* and what its exe is there */
+    ino_t ino;
+} scan_entry_t;
+
+typedef struct _foreach_context_t {
+    GHFunc func;
+    gpointer user_data;
+} foreach_context_t;
+
+static void replay_process(pid_t pid,
+                           const char* path,
+                           foreach_context_t* ctx) {
+    preload_metrics_count(METRIC_PROCESSES, 1);
+    if (accept_file(path, conf->system.exeprefix))
+        ctx->func(GUINT_TO_POINTER(pid), (gpointer)path, ctx->user_data);
+}
+
+/* the pids in procfs, read in bulk from the descriptor kept open of it */
+static GArray* read_pids(void) {
+    char buf[32768] __attribute__((aligned(__alignof__(proc_dirent_t))));
+    GArray* pids = g_array_new(FALSE, FALSE, sizeof(pid_t));
     pid_t selfpid = getpid();
+    long len;
+
+    if (proc_fd < 0) {
+        proc_fd = open(proc_get_root(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (proc_fd < 0)
+            g_error("failed opening %s: %s", proc_get_root(), strerror(errno));
+    } else {
+        lseek(proc_fd, 0, SEEK_SET);
+    }
+
+    while ((len = syscall(SYS_getdents64, proc_fd, buf, sizeof(buf))) > 0) {
+        long off;
 
-    proc = opendir("/proc");
-    if (!proc)
-        g_error("failed opening /proc: %s", strerror(errno));
+        for (off = 0; off < len;) {
+            proc_dirent_t* entry = (proc_dirent_t*)(buf + off);
 
-    while ((entry = readdir(proc))) {
-        if (/*entry->d_name &&*/ all_digits(entry->d_name)) {
-            pid_t pid;
-            char name[32];
-            char exe_buffer[FILELEN];
-            int len;
+            off += entry->d_reclen;
+            if (all_digits(entry->d_name)) {
+                pid_t pid = atoi(entry->d_name);
+                if (pid != selfpid)
+                    g_array_append_val(pids, pid);
+            }
+        }
+    }
+    return pids;
+}
 
-            pid = atoi(entry->d_name);
-            if (pid == selfpid)
-                continue;
+/* reads what the process runs, into entry */
+static void scan_process(scan_entry_t* entry, guint64 own_ns) {
+    char name[32];
+    char exe_buffer[FILELEN];
+    char ns_buffer[32];
+    struct stat buf;
+    ssize_t len;
+
+    g_snprintf(name, sizeof(name), "%d/exe", entry->pid);
+    len = readlinkat(proc_fd, name, exe_buffer, sizeof(exe_buffer));
+
+    if (len <= 0 /* error occured */
+        || len == sizeof(exe_buffer) /* name didn't fit completely */)
+        return;
+
+    exe_buffer[len] = '\0';
+
+    if (!sanitize_file(exe_buffer))
+        return;
+
+    /* the prefixes are of paths as processes see them, so the namespace
+     * only matters to those accepted */
+    entry->accepted = accept_file(exe_buffer, conf->system.exeprefix);
+    if (entry->accepted && own_ns) {
+        unsigned long long ns;
+
+        /* "mnt:[inode]", cheaper to read than to stat */
+        g_snprintf(name, sizeof(name), "%d/ns/mnt", entry->pid);
+        len = readlinkat(proc_fd, name, ns_buffer, sizeof(ns_buffer) - 1);
+        ns_buffer[MAX(len, 0)] = '\0';
+        if (1 == sscanf(ns_buffer, "mnt:[%llu]", &ns) && ns != own_ns) {
+            entry->ns = ns;
+            /* what it maps the exe as */
+            g_snprintf(name, sizeof(name), "%d/exe", entry->pid);
+            if (0 > fstatat(proc_fd, name, &buf, 0))
+                return;
+            entry->dev = buf.st_dev;
+            entry->ino = buf.st_ino;
+        }
+    }
 
-            g_snprintf(name, sizeof(name) - 1, "/proc/%s/exe", entry->d_name);
+    entry->exe = g_strdup(exe_buffer);
+}
 
-            len = readlink(name, exe_buffer, sizeof(exe_buffer));
+/* traces the process, and returns whether its exe is accepted.  that of
+ * a process of another mount namespace is replaced by ours of it */
+static gboolean accept_process(scan_entry_t* entry) {
+    const char* path;
+    dev_t dev;
+    ino_t ino;
 
-            if (len <= 0 /* error occured */
-                || len == sizeof(exe_buffer) /* name didn't fit completely */)
-                continue;
+    if (!entry->ns) {
+        preload_trace_proc(entry->pid, entry->exe);
+        return entry->accepted;
+    }
 
-            exe_buffer[len] = '\0';
+    path = preload_mntns_resolve(entry->pid, entry->ns, entry->dev,
+                                 entry->ino, entry->exe, &dev, &ino);
+    if (!path) {
+        preload_metrics_count(METRIC_FOREIGN_UNRESOLVED, 1);
+        return FALSE;
+    }
+    g_free(entry->exe);
+    entry->exe = g_strdup(path);
+    preload_trace_proc(entry->pid, entry->exe);
+    return TRUE;
+}
 
-            if (!sanitize_file(exe_buffer) ||
-                !accept_file(exe_buffer, conf->system.exeprefix))
-                continue;
+void proc_foreach(GHFunc func, gpointer user_data) {
+    guint64 own_ns;
+    GArray* pids;
+    guint i;
+
+    if (preload_trace_replaying()) {
+        foreach_context_t ctx;
+
+        ctx.func = func;
+        ctx.user_data = user_data;
+        preload_trace_replay_foreach(
+            (preload_trace_proc_func_t)G_CALLBACK(replay_process), &ctx);
+        return;
+    }
 
-            func(GUINT_TO_POINTER(pid), exe_buffer, user_data);
-        }
+    own_ns = preload_mntns_own();
+    pids = read_pids();
+    preload_metrics_count(METRIC_PROCESSES, pids->len);
+    for (i = 0; i < pids->len; i++) {
+        scan_entry_t entry = {0};
+
+        entry.pid = g_array_index(pids, pid_t, i);
+        scan_process(&entry, own_ns);
+        if (entry.exe && accept_process(&entry))
+            func(GUINT_TO_POINTER(entry.pid), entry.exe, user_data);
+        g_free(entry.exe);
     }
 
-    closedir(proc);
+    g_array_free(pids, TRUE);
 }
 
 #define open_file(filename)                                 \
@@ -226,24 +582,34 @@ void proc_foreach(GHFunc func, gpointer user_data) {
 void proc_get_memstat(preload_memory_t* mem) {
     static int pagesize = 0;
     char buf[4096];
+    char name[FILELEN];
+
+    if (preload_trace_replaying()) {
+        preload_trace_replay_memstat(mem);
+        return;
+    }
 
     memset(mem, 0, sizeof(*mem));
 
     if (!pagesize)
         pagesize = getpagesize();
 
-    open_file("/proc/meminfo");
+    g_snprintf(name, sizeof(name), "%s/meminfo", proc_get_root());
+    open_file(name);
     read_tag("MemTotal:", mem->total);
     read_tag("MemFree:", mem->free_);
+    read_tag("MemAvailable:", mem->available);
     read_tag("Buffers:", mem->buffers);
     read_tag("Cached:", mem->cached);
 
-    open_file("/proc/vmstat");
+    g_snprintf(name, sizeof(name), "%s/vmstat", proc_get_root());
+    open_file(name);
     read_tag("pgpgin", mem->pagein);
     read_tag("pgpgout", mem->pageout);
 
     if (!mem->pagein) {
-        open_file("/proc/stat");
+        g_snprintf(name, sizeof(name), "%s/stat", proc_get_root());
+        open_file(name);
         read_tag2("page", mem->pagein, mem->pageout);
     }
 
@@ -251,5 +617,47 @@ void proc_get_memstat(preload_memory_t* mem) {
     mem->pageout *= pagesize / 1024;
 
     if (!mem->total || !mem->pagein)
-        g_warning("failed to read memory stat, is /proc mounted?");
+        g_warning("failed to read memory stat, is %s mounted?",
+                  proc_get_root());
+
+    preload_trace_memstat(mem);
+}
+
+gboolean proc_get_stat(pid_t pid, pid_t* ppid, double* starttime) {
+    static long ticks = 0;
+    char buf[1024];
+    char name[FILELEN];
+    const char* p;
+    unsigned long long start;
+    int parent;
+
+    if (preload_trace_replaying())
+        return preload_trace_replay_stat(pid, ppid, starttime);
+
+    if (!ticks)
+        ticks = sysconf(_SC_CLK_TCK);
+
+    g_snprintf(name, sizeof(name), "%s/%d/stat", proc_get_root(), pid);
+    open_file(name);
+
+    /* comm may contain anything, including parentheses and spaces */
+    p = strrchr(buf, ')');
+    if (!p)
+        return FALSE;
+
+    /* state ppid pgrp session tty_nr tpgid flags minflt cminflt majflt
+     * cmajflt utime stime cutime cstime priority nice num_threads
+     * itrealvalue starttime */
+    if (2 != sscanf(p + 1,
+                    " %*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u"
+                    " %*d %*d %*d %*d %*d %*d %llu",
+                    &parent, &start))
+        return FALSE;
+
+    if (ppid)
+        *ppid = parent;
+    if (starttime)
+        *starttime = (double)start / ticks;
+    preload_trace_stat(pid, parent, (double)start / ticks);
+    return TRUE;
 }
@@ -26,7 +26,12 @@
 
 #include "common.h"
 #include "conf.h"
+#include "iobudget.h"
 #include "log.h"
+#include "metrics.h"
+#include "predictor.h"
+#include "pressure.h"
+#include "queue.h"
 #include "readahead.h"
 #include "state.h"
 
@@ -46,11 +51,13 @@
  *
  *   lnprob(Y) = log(P(Y=0)) = Σ log(P(Y=0|Xi)) = Σ log(1 - P(Y=1|Xi))
  *
+ * each term being scaled by the weight of the markov model.
  */
 static void markov_bid_for_exe(preload_markov_t* markov,
                                preload_exe_t* y,
                                int ystate,
-                               double correlation) {
+                               double correlation,
+                               double weight) {
     int state;
     double p_state_change;
     double p_y_runs_next;
@@ -85,10 +92,11 @@ static void markov_bid_for_exe(preload_markov_t* markov,
 
     p_runs = correlation * p_state_change * p_y_runs_next;
 
-    y->lnprob += log(1 - p_runs);
+    y->lnprob += weight * log(1 - p_runs);
 }
 
-static void markov_bid_in_exes(preload_markov_t* markov) {
+static void markov_bid_in_exes(preload_markov_t* markov,
+                               const double* weight) {
     double correlation;
 
     if (!markov->weight[markov->state][markov->state])
@@ -98,11 +106,29 @@ static void markov_bid_in_exes(preload_markov_t* markov) {
         conf->model.usecorrelation ? preload_markov_correlation(markov) : 1.0;
 
     if ((markov->state & 1) == 0) /* a not running */
-        markov_bid_for_exe(markov, markov->a, 1, correlation);
+        markov_bid_for_exe(markov, markov->a, 1, correlation, *weight);
     if ((markov->state & 2) == 0) /* b not running */
-        markov_bid_for_exe(markov, markov->b, 2, correlation);
+        markov_bid_for_exe(markov, markov->b, 2, correlation, *weight);
 }
 
+static void markov_exe_changed(preload_exe_t* exe) {
+    g_set_foreach(exe->markovs,
+                  (GFunc)G_CALLBACK(preload_markov_state_changed), NULL);
+}
+
+static void markov_bid(double weight) {
+    preload_markov_foreach((GFunc)G_CALLBACK(markov_bid_in_exes), &weight);
+}
+
+/* markov chains are part of the core model: they are created along with
+ * exes and saved with them, so there is no private data to keep here. */
+const preload_predictor_t preload_markov_predictor = {
+    .name = "markov",
+    .weight = &conf->model.markov,
+    .exe_changed = markov_exe_changed,
+    .bid = markov_bid,
+};
+
 static void map_zero_prob(preload_map_t* map) {
     map->lnprob = 0;
 }
@@ -126,21 +152,25 @@ static void exe_zero_prob(gpointer G_GNUC_UNUSED key, preload_exe_t* exe) {
  *
  *   P(M=1) = 1 - P(M=0)
  *   P(M=0) = Π P(M=0|Xi)
- *   P(M=0|Xi) = P(Xi=0)
+ *   P(M=0|Xi) = 1 - P(Xi=1) * P(M used|Xi runs)
+ *
+ * where P(M used|Xi runs) is exemap->prob, learned by the spy.
  *
  * So:
  *
- *   lnprob(M) = log(P(M=0)) = Σ log(P(M=0|Xi)) = Σ log(P(Xi=0)) = Σ lnprob(Xi)
+ *   lnprob(M) = log(P(M=0)) = Σ log(1 - (1 - e^lnprob(Xi)) * prob(Xi,M))
  *
+ * which is just Σ lnprob(Xi) when every map is always used.
  */
 static void exemap_bid_in_maps(preload_exemap_t* exemap, preload_exe_t* exe) {
     if (exe_is_running(exe)) {
         /* if exe is running, we vote against the map,
          * since it's most prolly in the memory already. */
-        /* FIXME: use exemap->prob, needs some theory work. */
         exemap->map->lnprob += 1;
-    } else {
+    } else if (!conf->model.usemapprob || exemap->prob >= 1) {
         exemap->map->lnprob += exe->lnprob;
+    } else {
+        exemap->map->lnprob += log1p(-(1 - exp(exe->lnprob)) * exemap->prob);
     }
 }
 
@@ -162,58 +192,347 @@ static void map_prob_print(preload_map_t* map) {
 #define max(a, b) ((a) > (b) ? (a) : (b))
 #define kb(v) ((int)(((v) + 1023) / 1024))
 
+/* estimated cost of reading a map from disk, expressed in kilobytes of
+ * sequential transfer: a fixed per-request overhead (seek, request
+ * setup) plus the length of the map itself. */
+#define READ_OVERHEAD_KB 128
+#define map_read_cost(map) (READ_OVERHEAD_KB + (double)kb((map)->length))
+
+/* probability that map is needed in next period */
+#define map_prob(map) (1 - exp((map)->lnprob))
+
+typedef struct _map_score_t {
+    preload_map_t* map;
+    double density; /* expected benefit per kilobyte */
+} map_score_t;
+
+static int map_density_compare(const map_score_t* a, const map_score_t* b) {
+    return a->density > b->density ? -1 : a->density < b->density ? 1 : 0;
+}
+
+/* greedy: walk maps in order of need and stop at the first one that
+ * doesn't fit. */
+static int select_greedy(GPtrArray* maps_arr,
+                         int memavail,
+                         GPtrArray* selected) {
+    preload_map_t* map;
+    int i = 0;
+
+    while (i < (int)(maps_arr->len) &&
+           (map = g_ptr_array_index(maps_arr, i)) && map->lnprob < 0 &&
+           kb(map->length) <= memavail) {
+        i++;
+
+        memavail -= kb(map->length);
+        g_ptr_array_add(selected, map);
+    }
+
+    return memavail;
+}
+
+/* knapsack: score every candidate by expected benefit per kilobyte,
+ *
+ *   density(M) = P(M=1) * cost(M) / size(M)
+ *
+ * and fill the budget greedily in order of density, skipping maps that
+ * don't fit instead of stopping at them.  maps are unique in maps_arr,
+ * and lnprob already combines the bids of every exe using a map, so a
+ * map shared by several predicted exes is charged only once. */
+static int select_knapsack(GPtrArray* maps_arr,
+                           int memavail,
+                           GPtrArray* selected) {
+    map_score_t* scores;
+    int i, count = 0;
+
+    scores = g_new(map_score_t, maps_arr->len);
+    for (i = 0; i < (int)(maps_arr->len); i++) {
+        preload_map_t* map = g_ptr_array_index(maps_arr, i);
+
+        /* maps_arr is sorted on lnprob, nothing useful beyond this */
+        if (map->lnprob >= 0)
+            break;
+        if (!map->length)
+            continue;
+
+        scores[count].map = map;
+        scores[count].density =
+            map_prob(map) * map_read_cost(map) / kb(map->length);
+        count++;
+    }
+
+    qsort(scores, count, sizeof(*scores), (GCompareFunc)map_density_compare);
+
+    for (i = 0; i < count && memavail > 0; i++) {
+        preload_map_t* map = scores[i].map;
+
+        if (kb(map->length) > memavail)
+            continue;
+
+        memavail -= kb(map->length);
+        g_ptr_array_add(selected, map);
+    }
+
+    g_free(scores);
+    return memavail;
+}
+
+int preload_prophet_select(GPtrArray* maps_arr,
+                           int memavail,
+                           GPtrArray* selected) {
+    switch (conf->model.selectstrategy) {
+        case SELECT_GREEDY:
+            break;
+
+        case SELECT_KNAPSACK:
+            return select_knapsack(maps_arr, memavail, selected);
+
+        default:
+            g_warning("Invalid value for config key model.selectstrategy: %d",
+                      conf->model.selectstrategy);
+            /* avoid warning every time */
+            conf->model.selectstrategy = SELECT_GREEDY;
+            break;
+    }
+
+    return select_greedy(maps_arr, memavail, selected);
+}
+
+/* expected number of bytes of selected maps that will actually be
+ * needed in next period, that is, Σ P(M=1) * length(M). */
+double preload_prophet_expected_hit(GPtrArray* selected) {
+    double hit = 0;
+    int i;
+
+    for (i = 0; i < (int)(selected->len); i++) {
+        preload_map_t* map = g_ptr_array_index(selected, i);
+        hit += map_prob(map) * map->length;
+    }
+
+    return hit;
+}
+
+/* Readahead effectiveness.  A map read in ahead of time is pending
+ * until an exe using it starts, a hit, or it leaves the page cache
+ * first, evicted, or prefetchwindow passes with neither, wasted.  By the
+ * time a launch is seen the exe has faulted its maps in anyway, so
+ * residency is sampled every cycle while pending instead, and a hit
+ * means the map was still cached as of the cycle before the launch. */
+
+/* prefetches to see before holding waste against a map */
+#define WASTE_MIN_PREFETCHED 3
+/* halve the counts past this, for recent behavior to count more */
+#define WASTE_MAX_PREFETCHED 64
+
+static void map_prefetched(preload_map_t* map) {
+    if (map->prefetch_time < 0) {
+        if (map->prefetched >= WASTE_MAX_PREFETCHED) {
+            map->prefetched /= 2;
+            map->hits /= 2;
+            map->evicted /= 2;
+            map->wasted /= 2;
+        }
+        map->prefetched++;
+        preload_metrics_count(METRIC_PREFETCH_MAPS, 1);
+        /* not again while pending, or a map selected every cycle and
+         * never used would never be found wasted */
+        map->prefetch_time = state->time;
+    }
+}
+
+static void exemap_check_hit(preload_exemap_t* exemap,
+                             gpointer G_GNUC_UNUSED data) {
+    preload_map_t* map = exemap->map;
+
+    if (map->prefetch_time < 0)
+        return;
+    if (conf->model.usemapprob && exemap->prob < MAPPROB_LEARNING_RATE)
+        return;
+
+    map->hits++;
+    map->prefetch_time = -1;
+    preload_metrics_count(METRIC_PREFETCH_HITS, 1);
+}
+
+static void exe_check_hits(preload_exe_t* exe) {
+    g_set_foreach(exe->exemaps, (GFunc)G_CALLBACK(exemap_check_hit), NULL);
+}
+
+static void map_check_pending(preload_map_t* map, int* pending) {
+    if (map->prefetch_time < 0)
+        return;
+
+    if (state->time - map->prefetch_time > conf->model.prefetchwindow) {
+        map->wasted++;
+        preload_metrics_count(METRIC_PREFETCH_WASTED, 1);
+    } else if (!preload_readahead_is_cached(map)) {
+        map->evicted++;
+        preload_metrics_count(METRIC_PREFETCH_EVICTED, 1);
+    } else {
+        (*pending)++;
+        return;
+    }
+    map->prefetch_time = -1;
+}
+
+/* settles what launched exes used first, then what else was read in */
+static void prophet_check_prefetched(void) {
+    int pending = 0;
+
+    g_slist_foreach(state->launched_exes, (GFunc)G_CALLBACK(exe_check_hits),
+                    NULL);
+    g_ptr_array_foreach(state->maps_arr, (GFunc)G_CALLBACK(map_check_pending),
+                        &pending);
+    preload_metrics_set(METRIC_PREFETCH_PENDING, pending);
+}
+
+/* scales the need of a map down by the fraction of its readaheads that
+ * were wasted, times wastepenalty. */
+static void map_penalize_waste(preload_map_t* map, const double* penalty) {
+    double waste;
+
+    if (map->lnprob >= 0 || map->prefetched < WASTE_MIN_PREFETCHED)
+        return;
+
+    waste = (double)(map->evicted + map->wasted) / map->prefetched;
+    map->lnprob = log1p(-map_prob(map) * (1 - *penalty * MIN(waste, 1)));
+}
+
+/* leaves the maps that do not fit in the I/O budget out of maps, whose
+ * order is that of need */
+static void prophet_take_iobudget(GPtrArray* maps) {
+    int n = preload_iobudget_take((preload_map_t**)maps->pdata, maps->len);
+
+    if (n < (int)maps->len) {
+        g_debug("I/O budget leaves %d of %u maps out", maps->len - n,
+                maps->len);
+        preload_metrics_count(METRIC_READAHEAD_THROTTLED, maps->len - n);
+        g_ptr_array_set_size(maps, n);
+    }
+}
+
 /* input is the list of maps sorted on the need.
  * decide a cutoff based on memory conditions and readhead. */
 void preload_prophet_readahead(GPtrArray* maps_arr) {
     int i;
     int memavail, memavailtotal; /* in kilobytes */
     preload_memory_t memstat;
-    preload_map_t* map;
+    GPtrArray* selected;
 
     proc_get_memstat(&memstat);
 
     /* memory we are allowed to use for prefetching */
     memavail = clamp_percent(conf->model.memtotal) * (memstat.total / 100) +
-               clamp_percent(conf->model.memfree) * (memstat.free_ / 100);
+               clamp_percent(conf->model.memfree) * (memstat.free_ / 100) +
+               clamp_percent(conf->model.memavailable) *
+                   (memstat.available / 100);
     memavail = max(0, memavail);
     memavail += clamp_percent(conf->model.memcached) * (memstat.cached / 100);
+    /* beyond that the kernel has to reclaim to make room */
+    if (memstat.available > 0 && memavail > memstat.available)
+        memavail = memstat.available;
 
     memavailtotal = memavail;
 
     memcpy(&(state->memstat), &memstat, sizeof(memstat));
     state->memstat_timestamp = state->time;
 
-    i = 0;
-    while (i < (int)(maps_arr->len) &&
-           (map = g_ptr_array_index(maps_arr, i)) && map->lnprob < 0 &&
-           kb(map->length) <= memavail) {
-        i++;
+    /* the queue waits for it to clear */
+    if (preload_pressure_high()) {
+        g_debug("memory under pressure, not preloading");
+        return;
+    }
 
-        memavail -= kb(map->length);
+    selected = g_ptr_array_new();
+    memavail = preload_prophet_select(maps_arr, memavail, selected);
 
-        if (preload_log_level >= 10)
-            map_prob_print(map);
-    }
+    if (preload_log_level >= 10)
+        g_ptr_array_foreach(selected, (GFunc)G_CALLBACK(map_prob_print), NULL);
 
     g_debug("%dkb available for preloading, using %dkb of it", memavailtotal,
             memavailtotal - memavail);
-
-    if (i) {
-        i = preload_readahead((preload_map_t**)maps_arr->pdata, i);
-        g_debug("readahead %d files", i);
-    } else {
+    preload_metrics_set(METRIC_MEMAVAIL, 1024. * memavailtotal);
+    preload_metrics_set(METRIC_MEMUSED, 1024. * (memavailtotal - memavail));
+
+    if (selected->len)
+        g_debug("expected %.0lfkb of it to be used",
+                preload_prophet_expected_hit(selected) / 1024);
+
+    preload_queue_update(selected);
+    i = preload_queue_run((GFunc)G_CALLBACK(map_prefetched), NULL);
+    if (i || preload_queue_length())
+        g_debug("readahead %d chunks, %d left in the queue", i,
+                preload_queue_length());
+    else
         g_debug("nothing to readahead");
+
+    g_ptr_array_free(selected, TRUE);
+}
+
+static void exemap_add_uncached(preload_exemap_t* exemap,
+                                GPtrArray* maps) {
+    preload_map_t* map = exemap->map;
+
+    /* already queued by another launched exe */
+    if (map->priv)
+        return;
+    /* not used the last few times the exe ran */
+    if (conf->model.usemapprob && exemap->prob < MAPPROB_LEARNING_RATE)
+        return;
+
+    map->priv = TRUE;
+    if (!preload_readahead_is_cached(map))
+        g_ptr_array_add(maps, map);
+}
+
+static void exe_add_uncached(preload_exe_t* exe, GPtrArray* maps) {
+    g_set_foreach(exe->exemaps, (GFunc)G_CALLBACK(exemap_add_uncached), maps);
+}
+
+static void map_clear_priv(preload_map_t* map) {
+    map->priv = FALSE;
+}
+
+/* exes that just started running are going to fault their maps in
+ * right away.  read in whatever of those is not cached yet, before
+ * speculating about anything else. */
+static void prophet_prefetch_launched(void) {
+    GPtrArray* maps;
+    int i;
+
+    if (!state->launched_exes)
+        return;
+
+    maps = g_ptr_array_new();
+    g_slist_foreach(state->launched_exes, (GFunc)G_CALLBACK(exe_add_uncached),
+                    maps);
+    g_ptr_array_foreach(state->maps_arr, (GFunc)G_CALLBACK(map_clear_priv),
+                        NULL);
+
+    prophet_take_iobudget(maps);
+    if (maps->len) {
+        i = preload_readahead((preload_map_t**)maps->pdata, maps->len);
+        g_debug("readahead %d files for %u launched exes", i,
+                g_slist_length(state->launched_exes));
     }
+
+    g_ptr_array_free(maps, TRUE);
 }
 
 void preload_prophet_predict(gpointer data) {
+    double penalty;
+
+    prophet_check_prefetched();
+
+    if (conf->system.prefetchonexec)
+        prophet_prefetch_launched();
+
     /* reset probabilities that we are gonna compute */
     g_hash_table_foreach(state->exes, (GHFunc)G_CALLBACK(exe_zero_prob), data);
     g_ptr_array_foreach(state->maps_arr, (GFunc)G_CALLBACK(map_zero_prob),
                         data);
 
-    /* markovs bid in exes */
-    preload_markov_foreach((GFunc)G_CALLBACK(markov_bid_in_exes), data);
+    /* models bid in exes */
+    preload_predictors_bid();
 
     if (preload_log_level >= 9)
         g_hash_table_foreach(state->exes, (GHFunc)G_CALLBACK(exe_prob_print),
@@ -222,6 +541,11 @@ void preload_prophet_predict(gpointer data) {
     /* exes bid in maps */
     preload_exemap_foreach((GHFunc)G_CALLBACK(exemap_bid_in_maps), data);
 
+    penalty = CLAMP(conf->model.wastepenalty, 0, 100) / 100.;
+    if (penalty > 0)
+        g_ptr_array_foreach(state->maps_arr,
+                            (GFunc)G_CALLBACK(map_penalize_waste), &penalty);
+
     /* sort maps on probability */
     g_ptr_array_sort(state->maps_arr, (GCompareFunc)map_prob_compare);
 
@@ -0,0 +1,204 @@
+/* queue.c - preload prefetch queue
+ *
+ * This file is part of preload.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "queue.h"
+
+#include "common.h"
+#include "conf.h"
+#include "iobudget.h"
+#include "log.h"
+#include "metrics.h"
+#include "pressure.h"
+#include "readahead.h"
+#include "trace.h"
+
+typedef struct _entry_t {
+    preload_map_t* map; /* referenced while queued */
+    GPtrArray* chunks;  /* of preload_map_t, the map itself if small */
+    guint next;         /* first chunk not read yet */
+    gboolean selected;  /* in the last update */
+} entry_t;
+
+static GHashTable* entries; /* preload_map_t -> entry_t */
+static GPtrArray* order;    /* of entry_t with chunks left, by need */
+
+static void entry_free(entry_t* entry) {
+    guint i;
+
+    for (i = 0; i < entry->chunks->len; i++) {
+        preload_map_t* chunk = g_ptr_array_index(entry->chunks, i);
+        if (chunk != entry->map)
+            preload_map_free(chunk);
+    }
+    g_ptr_array_free(entry->chunks, TRUE);
+    preload_map_unref(entry->map);
+    g_free(entry);
+}
+
+/* the simulated page cache of preload-sim knows whole maps only, and
+ * nothing of budgets or pressure that chunks are for anyway */
+static entry_t* entry_new(preload_map_t* map) {
+    entry_t* entry = g_new0(entry_t, 1);
+    size_t chunksize = conf->system.chunksize;
+
+    entry->map = map;
+    preload_map_ref(map);
+    entry->chunks = g_ptr_array_new();
+
+    if (!chunksize || map->length <= chunksize ||
+        preload_trace_replaying()) {
+        g_ptr_array_add(entry->chunks, map);
+    } else {
+        size_t offset;
+
+        for (offset = 0; offset < map->length; offset += chunksize)
+            g_ptr_array_add(
+                entry->chunks,
+                preload_map_new(map->path, map->offset + offset,
+                                MIN(chunksize, map->length - offset)));
+    }
+    return entry;
+}
+
+static gboolean entry_unselected(gpointer G_GNUC_UNUSED key,
+                                 entry_t* entry) {
+    if (entry->selected) {
+        entry->selected = FALSE;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void preload_queue_update(GPtrArray* selected) {
+    guint i;
+
+    if (!entries) {
+        entries = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                        (GDestroyNotify)entry_free);
+        order = g_ptr_array_new();
+    }
+
+    g_ptr_array_set_size(order, 0);
+    for (i = 0; i < selected->len; i++) {
+        preload_map_t* map = g_ptr_array_index(selected, i);
+        entry_t* entry = g_hash_table_lookup(entries, map);
+
+        if (!entry) {
+            entry = entry_new(map);
+            g_hash_table_insert(entries, map, entry);
+            /* cached already, none of our doing; it would only show up
+             * as a hit */
+            if (preload_readahead_is_cached(map))
+                entry->next = entry->chunks->len;
+        }
+        entry->selected = TRUE;
+        /* read all of already, but evicted since */
+        if (entry->next == entry->chunks->len &&
+            !preload_readahead_is_cached(map))
+            entry->next = 0;
+        if (entry->next < entry->chunks->len)
+            g_ptr_array_add(order, entry);
+    }
+
+    /* not needed anymore, whether read or not.  if selected again later,
+     * it is read again, it may well have been evicted by then */
+    g_hash_table_foreach_remove(entries, (GHRFunc)G_CALLBACK(entry_unselected),
+                                NULL);
+}
+
+/* the chunks to read this cycle, in order of need, for as long as memory
+ * pressure and the I/O budget allow.  they are checked chunk by chunk,
+ * so that what is left out is always the least needed */
+static void take_chunks(GPtrArray* chunks) {
+    guint i, c;
+
+    for (i = 0; order && i < order->len; i++) {
+        entry_t* entry = g_ptr_array_index(order, i);
+
+        for (c = entry->next; c < entry->chunks->len; c++) {
+            preload_map_t* chunk = g_ptr_array_index(entry->chunks, c);
+
+            if (preload_pressure_high()) {
+                g_debug("memory under pressure, leaving the queue for later");
+                return;
+            }
+            if (!preload_iobudget_take(&chunk, 1)) {
+                preload_metrics_count(METRIC_READAHEAD_THROTTLED,
+                                      preload_queue_length() - chunks->len);
+                return;
+            }
+            g_ptr_array_add(chunks, chunk);
+        }
+    }
+}
+
+/* all of it is read in one go, for readahead to sort and merge it as a
+ * whole, not cancelled halfway, so that what is counted read was */
+int preload_queue_run(GFunc done, gpointer data) {
+    GPtrArray* chunks = g_ptr_array_new();
+    guint first = 0; /* in order, of the entries read all of */
+    guint left;
+    int read;
+
+    take_chunks(chunks);
+    if (chunks->len)
+        preload_readahead_all((preload_map_t**)chunks->pdata, chunks->len);
+
+    /* taken in order, so the entries read are the first ones */
+    for (left = chunks->len; left; first++) {
+        entry_t* entry = g_ptr_array_index(order, first);
+        guint taken = MIN(left, entry->chunks->len - entry->next);
+
+        entry->next += taken;
+        left -= taken;
+        if (entry->next < entry->chunks->len)
+            break;
+        if (done)
+            done(entry->map, data);
+    }
+
+    if (order)
+        g_ptr_array_remove_range(order, 0, first);
+    preload_metrics_set(METRIC_QUEUE_CHUNKS, preload_queue_length());
+    read = chunks->len;
+    g_ptr_array_free(chunks, TRUE);
+    return read;
+}
+
+int preload_queue_length(void) {
+    int length = 0;
+    guint i;
+
+    for (i = 0; order && i < order->len; i++) {
+        entry_t* entry = g_ptr_array_index(order, i);
+        length += entry->chunks->len - entry->next;
+    }
+    return length;
+}
+
+void preload_queue_free(void) {
+    if (!entries)
+        return;
+
+    g_ptr_array_free(order, TRUE);
+    order = NULL;
+    g_hash_table_destroy(entries);
+    entries = NULL;
+}
@@ -23,44 +23,62 @@
 #include "readahead.h"
 
 #include <sys/ioctl.h>
+#include <sys/sysmacros.h>
 #include <sys/wait.h>
 
 #include "common.h"
 #include "conf.h"
+#include "fdcache.h"
+#include "iobudget.h"
 #include "log.h"
+#include "metrics.h"
+#include "pressure.h"
+#include "trace.h"
 #ifdef HAVE_LINUX_FS_H
+#include <linux/fiemap.h>
 #include <linux/fs.h>
 #endif
 
 static void set_block(preload_map_t* file, gboolean G_GNUC_UNUSED use_inode) {
     int fd = -1;
-    int block = 0;
     struct stat buf;
 
     /* in case we can get block, set to 0 to not retry */
     file->block = 0;
+    file->physical = FALSE;
 
-    fd = open(file->path, O_RDONLY);
-    if (fd < 0)
+    fd = preload_fdcache_open(file->path);
+    if (fd < 0 || 0 > fstat(fd, &buf))
         return;
 
-    if (0 > fstat(fd, &buf))
-        return;
-
-#ifdef FIBMAP
+#ifdef FS_IOC_FIEMAP
+    /* the extent the map starts in.  unlike FIBMAP, needs no privileges */
     if (!use_inode) {
-        block = file->offset / buf.st_blksize;
-        if (0 > ioctl(fd, FIBMAP, &block))
-            block = 0;
+        /* room for one extent after the header */
+        union {
+            struct fiemap map;
+            char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+        } fm;
+        struct fiemap_extent* extent = fm.map.fm_extents;
+
+        memset(&fm, 0, sizeof(fm));
+        fm.map.fm_start = file->offset;
+        fm.map.fm_length = MAX(file->length, 1);
+        fm.map.fm_extent_count = 1;
+        if (0 == ioctl(fd, FS_IOC_FIEMAP, &fm) && fm.map.fm_mapped_extents &&
+            !(extent->fe_flags &
+              (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_NOT_ALIGNED))) {
+            file->block = extent->fe_physical;
+            if (file->offset > extent->fe_logical)
+                file->block += file->offset - extent->fe_logical;
+            file->physical = TRUE;
+            return;
+        }
     }
 #endif
 
     /* fall back to inode number */
-    block = buf.st_ino;
-
-    file->block = block;
-
-    close(fd);
+    file->block = buf.st_ino;
 }
 
 /* Compare files by path */
@@ -84,7 +102,7 @@ static int map_block_compare(const preload_map_t** pa,
     const preload_map_t *a = *pa, *b = *pb;
     int i;
 
-    i = a->block - b->block;
+    i = a->block < b->block ? -1 : a->block > b->block;
     if (!i) /* no block? */
         i = strcmp(a->path, b->path);
     if (!i) /* same file */
@@ -95,28 +113,93 @@ static int map_block_compare(const preload_map_t** pa,
     return i;
 }
 
-static int procs = 0;
+/* a range of a file to read in one request */
+typedef struct _range_t {
+    const char* path;
+    size_t offset;
+    size_t length;
+    gint64 physical; /* disk address of its start, or -1 if unknown */
+    gboolean join;   /* read right after the previous one, by its reader */
+} range_t;
+
+/* a device maps are read from, and how best to read from it */
+typedef struct _device_t {
+    dev_t dev;
+    int rotational;   /* -1 if not a block device we know */
+    int nr_requests;  /* of its request queue, 0 if unknown */
+    int sortstrategy; /* order to read in */
+    int depth;        /* readers at a time, 0 for as many as allowed */
+
+    /* runtime, during preload_readahead: */
+    GPtrArray* files; /* to read from it */
+    GArray* ranges;   /* of range_t, after sorting and merging */
+    guint next;       /* next range to read */
+    int runs;         /* of ranges read, one reader each */
+    int readers;      /* running */
+} device_t;
+
+static const char* sort_names[] = {"none", "path", "inode", "block", "auto"};
+
+static GHashTable* devices; /* dev_t -> device_t, probed once */
+static device_t any_device; /* all of them, unless sortstrategy is auto */
+static GHashTable* readers; /* pid -> device_t, of readers running */
+static int procs = 0;       /* readers running, in all */
+
+static void reader_reaped(pid_t pid) {
+    device_t* device = g_hash_table_lookup(readers, GINT_TO_POINTER(pid));
+
+    procs--;
+    if (device) {
+        device->readers--;
+        g_hash_table_remove(readers, GINT_TO_POINTER(pid));
+    }
+}
+
+/* waits for any of the readers to terminate */
+static void wait_for_reader(void) {
+    int status;
+    pid_t pid = wait(&status);
+
+    if (pid > 0) {
+        reader_reaped(pid);
+    } else if (errno == ECHILD) {
+        /* reaped behind our back, forget about them all */
+        GHashTableIter iter;
+        device_t* device;
+
+        g_hash_table_iter_init(&iter, readers);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&device))
+            device->readers--;
+        g_hash_table_remove_all(readers);
+        procs = 0;
+    }
+}
 
 static void wait_for_children(void) {
     /* wait for child processes to terminate */
-    while (procs > 0) {
-        int status;
-        if (wait(&status) > 0)
-            procs--;
-    }
+    while (procs > 0)
+        wait_for_reader();
 }
 
-static void process_file(const char* path, size_t offset, size_t length) {
+/* reads count ranges, one after the other */
+static void process_ranges(device_t* device,
+                           const range_t* ranges,
+                           int count) {
     int fd = -1;
     int maxprocs = conf->system.maxprocs;
-
-    if (procs >= maxprocs)
-        wait_for_children();
+    int i;
 
     if (maxprocs > 0) {
         /* parallel reading */
 
-        int status = fork();
+        int status;
+
+        /* in the parent, for the cache to keep them open across cycles,
+         * what a reader opens is closed when it exits */
+        for (i = 0; i < count; i++)
+            preload_fdcache_open(ranges[i].path);
+
+        status = fork();
 
         if (status == -1) {
             /* ignore error, return */
@@ -126,19 +209,17 @@ static void process_file(const char* path, size_t offset, size_t length) {
         /* return immediately in the parent */
         if (status > 0) {
             procs++;
+            device->readers++;
+            g_hash_table_insert(readers, GINT_TO_POINTER(status), device);
+            preload_metrics_count(METRIC_READAHEAD_FORKS, 1);
             return;
         }
     }
 
-    fd = open(path, O_RDONLY | O_NOCTTY
-#ifdef O_NOATIME
-                        | O_NOATIME
-#endif
-    );
-    if (fd >= 0) {
-        readahead(fd, offset, length);
-
-        close(fd);
+    for (i = 0; i < count; i++) {
+        fd = preload_fdcache_open(ranges[i].path);
+        if (fd >= 0)
+            readahead(fd, ranges[i].offset, ranges[i].length);
     }
 
     if (maxprocs > 0) {
@@ -147,7 +228,9 @@ static void process_file(const char* path, size_t offset, size_t length) {
     }
 }
 
-static void sort_by_block_or_inode(preload_map_t** files, int file_count) {
+static void sort_by_block_or_inode(preload_map_t** files,
+                                   int file_count,
+                                   gboolean use_inode) {
     int i;
     gboolean need_block = FALSE;
 
@@ -165,15 +248,17 @@ static void sort_by_block_or_inode(preload_map_t** files, int file_count) {
 
         for (i = 0; i < file_count; i++)
             if (files[i]->block == -1)
-                set_block(files[i], conf->system.sortstrategy == SORT_INODE);
+                set_block(files[i], use_inode);
     }
 
     /* Sorting by block. */
     qsort(files, file_count, sizeof(*files), (GCompareFunc)map_block_compare);
 }
 
-static void sort_files(preload_map_t** files, int file_count) {
-    switch (conf->system.sortstrategy) {
+static void sort_files(preload_map_t** files,
+                       int file_count,
+                       int sortstrategy) {
+    switch (sortstrategy) {
         case SORT_NONE:
             break;
 
@@ -184,7 +269,8 @@ static void sort_files(preload_map_t** files, int file_count) {
 
         case SORT_INODE:
         case SORT_BLOCK:
-            sort_by_block_or_inode(files, file_count);
+            sort_by_block_or_inode(files, file_count,
+                                   sortstrategy == SORT_INODE);
             break;
 
         default:
@@ -192,44 +278,426 @@ static void sort_files(preload_map_t** files, int file_count) {
                       conf->system.sortstrategy);
             /* avoid warning every time */
             conf->system.sortstrategy = SORT_BLOCK;
+            sort_by_block_or_inode(files, file_count, FALSE);
             break;
     }
 }
 
-int preload_readahead(preload_map_t** files, int file_count) {
-    int i;
-    const char* path = NULL;
-    size_t offset = 0, length = 0;
-    int processed = 0;
+#define SYSDEVBLOCK "/sys/dev/block"
+#define MOUNTINFO "/proc/self/mountinfo"
 
-    sort_files(files, file_count);
-    for (i = 0; i < file_count; i++) {
-        if (path && offset <= files[i]->offset &&
-            offset + length >= files[i]->offset &&
-            0 == strcmp(path, files[i]->path)) {
+/* requests a rotational disk gets per reader, and a solid state one */
+#define ROTATIONAL_REQUESTS 32
+#define SOLID_REQUESTS 4
+
+static int read_queue_attr(const char* queue, const char* name, int def) {
+    char path[FILELEN];
+    char* contents = NULL;
+    int value = def;
+
+    g_snprintf(path, sizeof(path), "%s/%s", queue, name);
+    if (g_file_get_contents(path, &contents, NULL, NULL))
+        sscanf(contents, "%d", &value);
+    g_free(contents);
+    return value;
+}
+
+/* finds what the filesystem on the anonymous device dev, like btrfs or
+ * tmpfs, is mounted from.  returns 1 with *backing set if that is a
+ * block device, 0 if it is something else, -1 if dev is not mounted. */
+static int backing_device(dev_t dev, dev_t* backing) {
+    FILE* in;
+    char buffer[FILELEN * 4];
+    int found = -1;
+
+    in = fopen(MOUNTINFO, "r");
+    if (!in)
+        return -1;
+
+    /* id parent major:minor root mountpoint options... - type source */
+    while (found < 0 && fgets(buffer, sizeof(buffer) - 1, in)) {
+        char source[FILELEN];
+        unsigned int maj, min;
+        struct stat buf;
+        const char* p;
+
+        if (2 != sscanf(buffer, "%*d %*d %u:%u", &maj, &min) ||
+            makedev(maj, min) != dev)
+            continue;
+
+        found = 0;
+        p = strstr(buffer, " - ");
+        if (p && 1 == sscanf(p + 3, "%*s %" FILELENSTR "s", source) &&
+            0 == stat(source, &buf) && S_ISBLK(buf.st_mode)) {
+            *backing = buf.st_rdev;
+            found = 1;
+        }
+    }
+
+    fclose(in);
+    return found;
+}
+
+/* picks how to read from a device, from what sysfs says of its queue:
+ *
+ *   - rotational disks pay for every seek, so reads go sorted by block,
+ *     and only a few readers at a time, enough for the elevator to merge
+ *     and order requests without moving the head between too many;
+ *   - solid state ones do not care about order, so it is left as given,
+ *     that is of need, and they take many readers, up to a fraction of
+ *     their queue;
+ *   - anything else, like network and virtual filesystems, is sorted by
+ *     path, with as many readers as allowed.
+ *
+ * partitions have no queue of their own, it is their disk's.  anonymous
+ * devices neither, it is the one of the device mounted; when that is not
+ * found, they are sorted by block, as when nothing was known. */
+static device_t* device_get(dev_t dev) {
+    device_t* device;
+    char queue[FILELEN];
+    dev_t backing = dev;
+    int mounted = 1;
+
+    if (!devices)
+        devices = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL,
+                                        g_free);
+    device = g_hash_table_lookup(devices, &dev);
+    if (device)
+        return device;
+
+    device = g_new0(device_t, 1);
+    device->dev = dev;
+    g_hash_table_insert(devices, &device->dev, device);
+
+    if (!major(dev))
+        mounted = backing_device(dev, &backing);
+
+    g_snprintf(queue, sizeof(queue), SYSDEVBLOCK "/%u:%u/queue",
+               major(backing), minor(backing));
+    if (!g_file_test(queue, G_FILE_TEST_IS_DIR))
+        g_snprintf(queue, sizeof(queue), SYSDEVBLOCK "/%u:%u/../queue",
+                   major(backing), minor(backing));
+    device->rotational = read_queue_attr(queue, "rotational", -1);
+    device->nr_requests = read_queue_attr(queue, "nr_requests", 0);
+
+    if (mounted < 0) {
+        device->sortstrategy = SORT_BLOCK;
+        device->depth = 0;
+    } else if (device->rotational > 0) {
+        device->sortstrategy = SORT_BLOCK;
+        device->depth =
+            device->nr_requests
+                ? MAX(1, device->nr_requests / ROTATIONAL_REQUESTS)
+                : 1;
+    } else if (device->rotational == 0) {
+        device->sortstrategy = SORT_NONE;
+        device->depth = device->nr_requests / SOLID_REQUESTS;
+    } else {
+        device->sortstrategy = SORT_PATH;
+        device->depth = 0;
+    }
+
+    g_debug("readahead from device %u:%u: %s, %d requests: sorting by %s, "
+            "%d readers",
+            major(dev), minor(dev),
+            mounted < 0               ? "not found mounted"
+            : device->rotational > 0  ? "rotational"
+            : device->rotational == 0 ? "solid state"
+                                      : "not a block device",
+            device->nr_requests, sort_names[device->sortstrategy],
+            device->depth);
+    return device;
+}
+
+/* appends range to the plan of device.  on a sweep across the disk, a
+ * range that starts within gap of where the previous one ends joins the
+ * run of that one, to be read right after it by the same reader, for the
+ * block layer to merge their requests even across files */
+static void plan_append(device_t* device,
+                        range_t* range,
+                        gboolean sweep,
+                        size_t gap) {
+    if (sweep && range->physical >= 0 && device->ranges->len) {
+        range_t* last = &g_array_index(device->ranges, range_t,
+                                       device->ranges->len - 1);
+
+        range->join = last->physical >= 0 &&
+                      last->physical <= range->physical &&
+                      last->physical + (gint64)(last->length + gap) >=
+                          range->physical;
+    }
+    g_array_append_val(device->ranges, *range);
+}
+
+/* chunks of the queue are not to be merged back into whole maps, each is
+ * a point where reading may stop */
+static gboolean too_long(const range_t* range, const preload_map_t* file) {
+    size_t chunksize = (size_t)conf->system.chunksize;
+
+    return chunksize &&
+           file->offset + file->length - range->offset > chunksize;
+}
+
+/* sorts the files of a device and merges them into ranges: of the same
+ * file if they overlap, or on a sweep, are less than readgap apart, which
+ * is cheaper to read through than to seek over */
+static void plan_ranges(device_t* device) {
+    preload_map_t** files = (preload_map_t**)device->files->pdata;
+    range_t range = {NULL, 0, 0, -1, FALSE};
+    gboolean sweep = device->sortstrategy == SORT_BLOCK;
+    size_t gap = sweep ? conf->system.readgap : 0;
+    guint i;
+
+    if (!device->ranges)
+        device->ranges = g_array_new(FALSE, FALSE, sizeof(range_t));
+
+    sort_files(files, device->files->len, device->sortstrategy);
+    for (i = 0; i < device->files->len; i++) {
+        preload_metrics_count(METRIC_READAHEAD_BYTES, files[i]->length);
+        if (range.path && range.offset <= files[i]->offset &&
+            range.offset + range.length + gap >= files[i]->offset &&
+            !too_long(&range, files[i]) &&
+            0 == strcmp(range.path, files[i]->path)) {
             /* merge requests */
-            length = files[i]->offset + files[i]->length - offset;
+            range.length = MAX(range.length, files[i]->offset +
+                                                 files[i]->length -
+                                                 range.offset);
+            preload_metrics_count(METRIC_READAHEAD_MERGED, 1);
             continue;
         }
 
-        if (path) {
-            process_file(path, offset, length);
-            processed++;
-            path = NULL;
+        if (range.path)
+            plan_append(device, &range, sweep, gap);
+
+        range.path = files[i]->path;
+        range.offset = files[i]->offset;
+        range.length = files[i]->length;
+        range.physical = files[i]->physical ? files[i]->block : -1;
+        range.join = FALSE;
+    }
+
+    if (range.path)
+        plan_append(device, &range, sweep, gap);
+}
+
+/* groups files by the device they are on, unless told how to sort them
+ * all.  returns the devices with anything to read */
+static GPtrArray* plan_devices(preload_map_t** files, int file_count) {
+    GPtrArray* active = g_ptr_array_new();
+    GHashTable* paths; /* path -> device_t, not to stat again */
+    int i;
+
+    if (conf->system.sortstrategy != SORT_AUTO) {
+        any_device.sortstrategy = conf->system.sortstrategy;
+        any_device.files = g_ptr_array_sized_new(file_count);
+        for (i = 0; i < file_count; i++)
+            g_ptr_array_add(any_device.files, files[i]);
+        g_ptr_array_add(active, &any_device);
+        return active;
+    }
+
+    paths = g_hash_table_new(g_str_hash, g_str_equal);
+    for (i = 0; i < file_count; i++) {
+        device_t* device = g_hash_table_lookup(paths, files[i]->path);
+
+        if (!device) {
+            int fd = preload_fdcache_open(files[i]->path);
+            struct stat buf;
+
+            /* not there, nothing will be read.  any device would do */
+            device = device_get(fd >= 0 && 0 == fstat(fd, &buf) ? buf.st_dev
+                                                                 : 0);
+            g_hash_table_insert(paths, files[i]->path, device);
+        }
+        if (!device->files) {
+            device->files = g_ptr_array_new();
+            g_ptr_array_add(active, device);
+        }
+        g_ptr_array_add(device->files, files[i]);
+    }
+    g_hash_table_destroy(paths);
+
+    return active;
+}
+
+/* reads the ranges of all devices, a run at a time, taking turns between
+ * them, and at most depth readers on each at a time.  if cancellable,
+ * stops when memory pressure rises.  returns the number of ranges read */
+static int read_ranges(GPtrArray* active, gboolean cancellable) {
+    int maxprocs = conf->system.maxprocs;
+    int processed = 0;
+    gboolean left;
+    guint i, end;
+
+    do {
+        gboolean issued = FALSE;
+
+        left = FALSE;
+        for (i = 0; i < active->len; i++) {
+            device_t* device = g_ptr_array_index(active, i);
+
+            if (device->next >= device->ranges->len)
+                continue;
+            left = TRUE;
+            if (maxprocs > 0 &&
+                (procs >= maxprocs ||
+                 (device->depth && device->readers >= device->depth)))
+                continue;
+
+            /* do not add to it, if memory got tight since we began */
+            if (cancellable && preload_pressure_high())
+                goto cancel;
+
+            end = device->next + 1;
+            while (end < device->ranges->len &&
+                   g_array_index(device->ranges, range_t, end).join)
+                end++;
+
+            process_ranges(device,
+                           &g_array_index(device->ranges, range_t,
+                                          device->next),
+                           end - device->next);
+            processed += end - device->next;
+            device->next = end;
+            device->runs++;
+            issued = TRUE;
         }
 
-        path = files[i]->path;
-        offset = files[i]->offset;
-        length = files[i]->length;
+        if (left && !issued)
+            wait_for_reader();
+    } while (left);
+
+    return processed;
+
+cancel:
+    for (i = 0; i < active->len; i++) {
+        device_t* device = g_ptr_array_index(active, i);
+        int cancelled = device->ranges->len - device->next;
+
+        if (cancelled > 0) {
+            g_debug("memory under pressure, cancelling readahead of %d "
+                    "ranges",
+                    cancelled);
+            preload_metrics_count(METRIC_READAHEAD_CANCELLED, cancelled);
+        }
+    }
+    return processed;
+}
+
+static void device_done(device_t* device, int* runs) {
+    *runs += device->runs;
+    g_ptr_array_free(device->files, TRUE);
+    device->files = NULL;
+    g_array_set_size(device->ranges, 0);
+    device->next = 0;
+    device->runs = 0;
+}
+
+gboolean preload_readahead_is_cached(const preload_map_t* map) {
+    int fd;
+    struct stat buf;
+    size_t length, pages, i;
+    unsigned char* vec;
+    void* addr;
+    gboolean cached = TRUE;
+    long pagesize = getpagesize();
+
+    if (preload_trace_replaying())
+        return preload_trace_replay_hooks()->is_cached(map);
+
+    fd = preload_fdcache_open(map->path);
+    if (fd < 0) /* nothing we can read anyway */
+        return TRUE;
+
+    /* the tail of a map beyond the end of file is never cached */
+    length = map->length;
+    if (0 == fstat(fd, &buf) && map->offset + length > (size_t)buf.st_size)
+        length = buf.st_size > (off_t)map->offset
+                     ? buf.st_size - map->offset
+                     : 0;
+    if (!length)
+        return TRUE;
+
+    addr = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, map->offset);
+    if (addr == MAP_FAILED)
+        return FALSE;
+
+    pages = (length + pagesize - 1) / pagesize;
+    vec = g_new(unsigned char, pages);
+    if (0 == mincore(addr, length, vec)) {
+        for (i = 0; i < pages && cached; i++)
+            cached = vec[i] & 1;
+    } else {
+        cached = FALSE;
     }
 
-    if (path) {
-        process_file(path, offset, length);
-        processed++;
-        path = NULL;
+    g_free(vec);
+    munmap(addr, length);
+    return cached;
+}
+
+static int readahead_files(preload_map_t** files,
+                           int file_count,
+                           gboolean cancellable) {
+    GPtrArray* active;
+    int processed, runs = 0;
+    int ioprio;
+
+    if (preload_trace_replaying()) {
+        preload_trace_replay_hooks()->readahead(files, file_count);
+        return file_count;
     }
 
+    preload_metrics_begin(METRIC_PHASE_READAHEAD);
+    if (!readers)
+        readers = g_hash_table_new(g_direct_hash, g_direct_equal);
+    /* forked readers inherit it */
+    ioprio = preload_iobudget_idle();
+
+    active = plan_devices(files, file_count);
+    g_ptr_array_foreach(active, (GFunc)G_CALLBACK(plan_ranges), NULL);
+    processed = read_ranges(active, cancellable);
     wait_for_children();
+    g_ptr_array_foreach(active, (GFunc)G_CALLBACK(device_done), &runs);
+    g_ptr_array_free(active, TRUE);
+
+    preload_iobudget_restore(ioprio);
 
+    g_debug("planned %d maps into %d ranges, read in %d runs", file_count,
+            processed, runs);
+    preload_metrics_count(METRIC_READAHEAD_MAPS, file_count);
+    preload_metrics_count(METRIC_READAHEAD_RANGES, processed);
+    preload_metrics_count(METRIC_READAHEAD_RUNS, runs);
+    preload_metrics_end(METRIC_PHASE_READAHEAD);
     return processed;
 }
+
+int preload_readahead(preload_map_t** files, int file_count) {
+    return readahead_files(files, file_count, TRUE);
+}
+
+int preload_readahead_all(preload_map_t** files, int file_count) {
+    return readahead_files(files, file_count, FALSE);
+}
+
+static void device_dump(gpointer G_GNUC_UNUSED key, device_t* device) {
+    fprintf(stderr, "device %u:%u = %s, %d requests: sort by %s, ",
+            major(device->dev), minor(device->dev),
+            device->rotational > 0    ? "rotational"
+            : device->rotational == 0 ? "solid state"
+                                      : "not a block device",
+            device->nr_requests, sort_names[device->sortstrategy]);
+    if (device->depth)
+        fprintf(stderr, "%d readers\n", device->depth);
+    else
+        fprintf(stderr, "any number of readers\n");
+}
+
+void preload_readahead_dump_log(void) {
+    fprintf(stderr, "readahead devices:\n");
+    if (conf->system.sortstrategy != SORT_AUTO)
+        fprintf(stderr, "all = sort by %s\n",
+                sort_names[CLAMP(conf->system.sortstrategy, 0, SORT_AUTO)]);
+    else if (devices)
+        g_hash_table_foreach(devices, (GHFunc)G_CALLBACK(device_dump), NULL);
+}
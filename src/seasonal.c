@@ -0,0 +1,199 @@
+/* seasonal.c - preload time-of-week prediction model
+ *
+ * This file is part of preload.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include <math.h>
+
+#include "common.h"
+#include "conf.h"
+#include "predictor.h"
+#include "state.h"
+#include "trace.h"
+
+#define TAG_EXPOSURE "EXPOSURE"
+#define TAG_SEASON "SEASON"
+
+/* how far ahead the model looks, in seconds, and the minimum observed
+ * time of an hour slot before its rates are trusted. */
+#define SEASONAL_HORIZON (15 * minutes)
+#define SEASONAL_MIN_EXPOSURE (1 * hours)
+
+/* a slot is halved, its exposure and the launches counted in it, once
+ * watched for this long, so that recent weeks weigh as much as all the
+ * older ones */
+#define SEASONAL_MAX_EXPOSURE (8 * hours)
+
+/* hour-of-week slot of a wall-clock time, 0 being Sunday 00:00-00:59. */
+static int hour_of_week(time_t t) {
+    struct tm tm;
+
+    if (!localtime_r(&t, &tm))
+        return 0;
+    return tm.tm_wday * 24 + tm.tm_hour;
+}
+
+static void seasonal_exe_changed(preload_exe_t* exe) {
+    if (!exe_is_running(exe))
+        return;
+
+    if (!exe->launches)
+        exe->launches = g_new0(int, HOURS_PER_WEEK);
+    exe->launches[hour_of_week(preload_trace_wallclock())]++;
+}
+
+static void exe_halve_launches(gpointer G_GNUC_UNUSED key,
+                               preload_exe_t* exe,
+                               const int* hour) {
+    if (exe->launches)
+        exe->launches[*hour] /= 2;
+}
+
+static void seasonal_tick(int period) {
+    int hour = hour_of_week(preload_trace_wallclock());
+
+    state->exposure[hour] += period;
+    if (state->exposure[hour] < SEASONAL_MAX_EXPOSURE)
+        return;
+
+    state->exposure[hour] /= 2;
+    g_hash_table_foreach(state->exes, (GHFunc)G_CALLBACK(exe_halve_launches),
+                         &hour);
+}
+
+typedef struct _seasonal_bid_context_t {
+    double weight;
+    int hour;
+} seasonal_bid_context_t;
+
+/* Computes the P(Y launches in the coming horizon | hour of week)
+ * and bids in for the Y. Y should not be running.
+ *
+ * Launches of Y in hour slot h are taken as a Poisson process with rate
+ * λ = launches(Y,h) / exposure(h), and h is the slot at the end of the
+ * horizon, so that Y is prefetched ahead of its usual burst:
+ *
+ *                                              -λ.horizon
+ *   P(Y launches in time < horizon) = 1 - e
+ */
+static void exe_seasonal_bid(gpointer G_GNUC_UNUSED key,
+                             preload_exe_t* exe,
+                             const seasonal_bid_context_t* ctx) {
+    int hour = ctx->hour;
+    double rate, p_runs;
+
+    if (!exe->launches || exe_is_running(exe) || !exe->launches[hour] ||
+        state->exposure[hour] < SEASONAL_MIN_EXPOSURE)
+        return;
+
+    rate = (double)exe->launches[hour] / state->exposure[hour];
+    p_runs = 1 - exp(-rate * SEASONAL_HORIZON);
+
+    exe->lnprob += ctx->weight * log(1 - p_runs);
+}
+
+static void seasonal_bid(double weight) {
+    seasonal_bid_context_t ctx;
+
+    ctx.weight = weight;
+    ctx.hour = hour_of_week(preload_trace_wallclock() + SEASONAL_HORIZON);
+    g_hash_table_foreach(state->exes, (GHFunc)G_CALLBACK(exe_seasonal_bid),
+                         &ctx);
+}
+
+/* reads a sparse list of "slot:count" pairs into slots */
+static const char* read_slots(char* line, int* slots) {
+    int hour, count, n;
+
+    while (2 == sscanf(line, " %d:%d%n", &hour, &count, &n)) {
+        if (hour < 0 || hour >= HOURS_PER_WEEK || count < 0)
+            return "invalid syntax";
+        line += n;
+        slots[hour] = count;
+    }
+
+    return NULL;
+}
+
+static const char* seasonal_read(const char* tag,
+                                 char* line,
+                                 GHashTable* exes) {
+    int i, n;
+    preload_exe_t* exe;
+
+    n = 0;
+    if (1 > sscanf(line, "%d%n", &i, &n))
+        return "invalid syntax";
+    line += n;
+
+    if (!strcmp(tag, TAG_EXPOSURE)) {
+        if (i != HOURS_PER_WEEK)
+            return "invalid syntax";
+        return read_slots(line, state->exposure);
+    }
+
+    exe = g_hash_table_lookup(exes, GINT_TO_POINTER(i));
+    if (!exe)
+        return "invalid index";
+
+    if (!exe->launches)
+        exe->launches = g_new0(int, HOURS_PER_WEEK);
+    return read_slots(line, exe->launches);
+}
+
+/* appends the non-zero slots as a sparse list of "slot:count" */
+static void write_slots(const int* slots, GString* out) {
+    int hour;
+
+    for (hour = 0; hour < HOURS_PER_WEEK; hour++) {
+        if (slots[hour])
+            g_string_append_printf(out, "\t%d:%d", hour, slots[hour]);
+    }
+}
+
+static void write_season(gpointer G_GNUC_UNUSED key,
+                         preload_exe_t* exe,
+                         GString* out) {
+    if (!exe->launches)
+        return;
+
+    g_string_append_printf(out, "%s\t%d", TAG_SEASON, exe->seq);
+    write_slots(exe->launches, out);
+    g_string_append_c(out, '\n');
+}
+
+static void seasonal_write(GString* out) {
+    g_string_append_printf(out, "%s\t%d", TAG_EXPOSURE, HOURS_PER_WEEK);
+    write_slots(state->exposure, out);
+    g_string_append_c(out, '\n');
+
+    g_hash_table_foreach(state->exes, (GHFunc)G_CALLBACK(write_season), out);
+}
+
+static const char* const seasonal_tags[] = {TAG_EXPOSURE, TAG_SEASON, NULL};
+
+const preload_predictor_t preload_seasonal_predictor = {
+    .name = "seasonal",
+    .weight = &conf->model.seasonal,
+    .exe_changed = seasonal_exe_changed,
+    .tick = seasonal_tick,
+    .bid = seasonal_bid,
+    .tags = seasonal_tags,
+    .read = seasonal_read,
+    .write = seasonal_write,
+};
@@ -0,0 +1,270 @@
+/* spawn.c - preload parent/child spawn graph prediction model
+ *
+ * This file is part of preload.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include <math.h>
+
+#include "common.h"
+#include "conf.h"
+#include "predictor.h"
+#include "state.h"
+
+#define TAG_SPAWNER "SPAWNER"
+#define TAG_SPAWN "SPAWN"
+
+/* children showing up later than this after their parent started are
+ * not considered spawned by it, in seconds. */
+#define SPAWN_MAX_DELAY (1 * minutes)
+
+/* spawn_edge_t: a child exe spawned by a parent exe. */
+typedef struct _spawn_edge_t {
+    int count;    /* number of processes of the child spawned. */
+    double delay; /* mean seconds from the parent start to the child. */
+} spawn_edge_t;
+
+/* spawn_parent_t: the children of an exe, tracked or not.  launchers
+ * and shells are mostly too small to be tracked, yet they are the ones
+ * starting the applications. */
+typedef struct _spawn_parent_t {
+    int starts;           /* number of processes of the exe seen starting. */
+    GHashTable* children; /* child exe -> spawn_edge_t */
+
+    /* runtime: */
+    int start_time; /* last time a process of the exe started, or -1. */
+} spawn_parent_t;
+
+static GHashTable* parents; /* exe path -> spawn_parent_t */
+
+static void parent_free(spawn_parent_t* sp) {
+    g_hash_table_destroy(sp->children);
+    g_free(sp);
+}
+
+static spawn_parent_t* parent_get(const char* path) {
+    spawn_parent_t* sp;
+
+    sp = g_hash_table_lookup(parents, path);
+    if (!sp) {
+        sp = g_new0(spawn_parent_t, 1);
+        sp->children =
+            g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+        sp->start_time = -1;
+        g_hash_table_insert(parents, g_strdup(path), sp);
+    }
+    return sp;
+}
+
+static spawn_edge_t* edge_get(spawn_parent_t* sp, preload_exe_t* child) {
+    spawn_edge_t* edge;
+
+    edge = g_hash_table_lookup(sp->children, child);
+    if (!edge) {
+        edge = g_new0(spawn_edge_t, 1);
+        g_hash_table_insert(sp->children, child, edge);
+    }
+    return edge;
+}
+
+static void spawn_init(void) {
+    parents = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                    (GDestroyNotify)parent_free);
+}
+
+static void spawn_free(void) {
+    g_hash_table_destroy(parents);
+    parents = NULL;
+}
+
+static void spawn_spawned(const char* path, const char* parent, int delay) {
+    preload_exe_t* exe;
+    spawn_parent_t* sp;
+    spawn_edge_t* edge;
+
+    /* forks of itself, like a browser's, are no new start of it */
+    if (parent && !strcmp(parent, path))
+        return;
+
+    /* count the starts of tracked exes, and of the untracked ones that
+     * spawned some before; anything else is not worth remembering */
+    exe = g_hash_table_lookup(state->exes, path);
+    sp = exe ? parent_get(path) : g_hash_table_lookup(parents, path);
+    if (sp) {
+        sp->starts++;
+        sp->start_time = state->time;
+    }
+
+    if (!exe || !parent || delay < 0 || delay > SPAWN_MAX_DELAY)
+        return;
+
+    sp = parent_get(parent);
+    sp->starts = MAX(sp->starts, 1);
+    edge = edge_get(sp, exe);
+    edge->count++;
+    edge->delay += (delay - edge->delay) / edge->count;
+}
+
+static void parent_expire(gpointer G_GNUC_UNUSED key, spawn_parent_t* sp) {
+    if (sp->start_time >= 0 &&
+        state->time - sp->start_time > SPAWN_MAX_DELAY + conf->model.cycle)
+        sp->start_time = -1;
+}
+
+static void spawn_tick(int G_GNUC_UNUSED period) {
+    g_hash_table_foreach(parents, (GHFunc)G_CALLBACK(parent_expire), NULL);
+}
+
+typedef struct _spawn_bid_context_t {
+    double weight;
+    spawn_parent_t* sp;
+    int elapsed;
+} spawn_bid_context_t;
+
+/* Computes P(Y is spawned | parent X just started) and bids in for the
+ * Y, for as long as Y is still expected to show up.  Y should not be
+ * running:
+ *
+ *                          count(X→Y)
+ *   P(Y spawned | X) = ----------------
+ *                       starts(X) + 1
+ */
+static void edge_bid(preload_exe_t* child,
+                     const spawn_edge_t* edge,
+                     const spawn_bid_context_t* ctx) {
+    double p_runs;
+
+    if (exe_is_running(child) ||
+        ctx->elapsed > edge->delay + conf->model.cycle)
+        return;
+
+    p_runs = (double)MIN(edge->count, ctx->sp->starts) / (ctx->sp->starts + 1);
+    child->lnprob += ctx->weight * log(1 - p_runs);
+}
+
+static void parent_bid(const char* path,
+                       spawn_parent_t* sp,
+                       spawn_bid_context_t* ctx) {
+    preload_exe_t* exe;
+
+    if (sp->start_time < 0)
+        return;
+
+    /* a tracked parent is known to have exited; for others, the
+     * expected delays tell */
+    exe = g_hash_table_lookup(state->exes, path);
+    if (exe && !exe_is_running(exe))
+        return;
+
+    ctx->sp = sp;
+    ctx->elapsed = state->time - sp->start_time;
+    g_hash_table_foreach(sp->children, (GHFunc)G_CALLBACK(edge_bid), ctx);
+}
+
+static void spawn_bid(double weight) {
+    spawn_bid_context_t ctx;
+
+    ctx.weight = weight;
+    g_hash_table_foreach(parents, (GHFunc)G_CALLBACK(parent_bid), &ctx);
+}
+
+static const char* spawn_read(const char* tag, char* line, GHashTable* exes) {
+    preload_exe_t* child;
+    spawn_edge_t* edge;
+    char uri[FILELEN];
+    char* path;
+    int j, count;
+    double delay;
+
+    if (!strcmp(tag, TAG_SPAWNER)) {
+        if (2 > sscanf(line, "%d %" FILELENSTR "s", &count, uri) || count < 0)
+            return "invalid syntax";
+        path = g_filename_from_uri(uri, NULL, NULL);
+        if (!path)
+            return "invalid uri";
+        parent_get(path)->starts = count;
+        g_free(path);
+        return NULL;
+    }
+
+    if (4 > sscanf(line, "%d %d %lg %" FILELENSTR "s", &j, &count, &delay,
+                   uri) ||
+        count <= 0 || delay < 0)
+        return "invalid syntax";
+    child = g_hash_table_lookup(exes, GINT_TO_POINTER(j));
+    if (!child)
+        return "invalid index";
+    path = g_filename_from_uri(uri, NULL, NULL);
+    if (!path)
+        return "invalid uri";
+
+    edge = edge_get(parent_get(path), child);
+    edge->count = count;
+    edge->delay = delay;
+    g_free(path);
+    return NULL;
+}
+
+typedef struct _spawn_write_context_t {
+    const char* uri;
+    GString* out;
+} spawn_write_context_t;
+
+static void write_edge(preload_exe_t* child,
+                       const spawn_edge_t* edge,
+                       spawn_write_context_t* ctx) {
+    g_string_append_printf(ctx->out, "%s\t%d\t%d\t%lg\t%s\n", TAG_SPAWN,
+                           child->seq, edge->count, edge->delay, ctx->uri);
+}
+
+static void write_parent(const char* path,
+                         const spawn_parent_t* sp,
+                         GString* out) {
+    spawn_write_context_t ctx;
+    char* uri;
+
+    uri = g_filename_to_uri(path, NULL, NULL);
+    if (!uri)
+        return;
+
+    g_string_append_printf(out, "%s\t%d\t%s\n", TAG_SPAWNER, sp->starts,
+                           uri);
+
+    ctx.uri = uri;
+    ctx.out = out;
+    g_hash_table_foreach(sp->children, (GHFunc)G_CALLBACK(write_edge), &ctx);
+    g_free(uri);
+}
+
+static void spawn_write(GString* out) {
+    g_hash_table_foreach(parents, (GHFunc)G_CALLBACK(write_parent), out);
+}
+
+static const char* const spawn_tags[] = {TAG_SPAWNER, TAG_SPAWN, NULL};
+
+const preload_predictor_t preload_spawn_predictor = {
+    .name = "spawn",
+    .weight = &conf->model.spawn,
+    .init = spawn_init,
+    .free = spawn_free,
+    .spawned = spawn_spawned,
+    .tick = spawn_tick,
+    .bid = spawn_bid,
+    .tags = spawn_tags,
+    .read = spawn_read,
+    .write = spawn_write,
+};
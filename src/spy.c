@@ -24,13 +24,45 @@
 
 #include "common.h"
 #include "conf.h"
+#include "metrics.h"
+#include "predictor.h"
 #include "proc.h"
 #include "state.h"
+#include "trace.h"
 
 static GSList* state_changed_exes;
 static GSList* new_running_exes;
 static GHashTable* new_exes;
 
+/* all processes, pid -> exe path, as of the last scan, and the one in
+ * progress, and the pids that were not there or ran another exe last
+ * time. */
+static GHashTable* running_pids;
+static GHashTable* new_pids;
+static GSList* started_pids;
+
+/* whether the exe at path was found too small to be worth it, and not
+ * so long ago that it deserves another look */
+static gboolean is_bad_exe(const char* path) {
+    preload_badexe_t* badexe = g_hash_table_lookup(state->bad_exes, path);
+
+    if (!badexe)
+        return FALSE;
+    if (conf->model.badexettl > 0 &&
+        state->time - badexe->update_time >= conf->model.badexettl) {
+        g_hash_table_remove(state->bad_exes, path);
+        return FALSE;
+    }
+
+    preload_metrics_count(METRIC_BAD_EXE_HITS, 1);
+    /* new exes are read once a scan, however many processes they have */
+    if (badexe->hit_time != state->time) {
+        badexe->hit_time = state->time;
+        preload_metrics_count(METRIC_MAPS_READS_AVOIDED, 1);
+    }
+    return TRUE;
+}
+
 /* for every process, check whether we know what it is, and add it
  * to appropriate list for further analysis. */
 static void running_process_callback(pid_t pid, const char* path) {
@@ -38,6 +70,14 @@ static void running_process_callback(pid_t pid, const char* path) {
 
     g_return_if_fail(path);
 
+    /* every process counts, tracked or not, as the parent of the ones
+     * it spawns */
+    if (running_pids &&
+        g_strcmp0(g_hash_table_lookup(running_pids, GINT_TO_POINTER(pid)),
+                  path))
+        started_pids = g_slist_prepend(started_pids, GINT_TO_POINTER(pid));
+    g_hash_table_insert(new_pids, GINT_TO_POINTER(pid), g_strdup(path));
+
     exe = g_hash_table_lookup(state->exes, path);
     if (exe) {
         /* already existing exe */
@@ -46,11 +86,13 @@ static void running_process_callback(pid_t pid, const char* path) {
         if (!exe_is_running(exe)) {
             new_running_exes = g_slist_prepend(new_running_exes, exe);
             state_changed_exes = g_slist_prepend(state_changed_exes, exe);
+            state->launched_exes = g_slist_prepend(state->launched_exes, exe);
         }
 
         /* update timestamp */
         exe->running_timestamp = state->time;
-    } else if (!g_hash_table_lookup(state->bad_exes, path)) {
+        exe->pid = pid;
+    } else if (!is_bad_exe(path)) {
         /* an exe we have never seen before, just queue it */
         g_hash_table_insert(new_exes, g_strdup(path), GUINT_TO_POINTER(pid));
     }
@@ -65,40 +107,118 @@ static void already_running_exe_callback(preload_exe_t* exe) {
         state_changed_exes = g_slist_prepend(state_changed_exes, exe);
 }
 
+/* a process showed up since the last scan.  find out who spawned it,
+ * and how long after its own start. */
+static void started_pid_callback(gpointer pid_p) {
+    pid_t pid = GPOINTER_TO_INT(pid_p);
+    pid_t ppid;
+    double start, parent_start;
+    const char *path, *parent;
+    int delay = 0;
+
+    path = g_hash_table_lookup(new_pids, pid_p);
+    if (!proc_get_stat(pid, &ppid, &start)) /* process died or something */
+        return;
+
+    parent = g_hash_table_lookup(new_pids, GINT_TO_POINTER(ppid));
+    if (parent && proc_get_stat(ppid, NULL, &parent_start))
+        delay = (int)(start - parent_start);
+    else
+        parent = NULL;
+
+    preload_predictors_spawned(path, parent, delay);
+}
+
+static void exemap_update_prob(preload_exemap_t* exemap, GHashTable* used) {
+    double sample = g_hash_table_lookup(used, exemap->map) ? 1 : 0;
+    exemap->prob += (sample - exemap->prob) * MAPPROB_LEARNING_RATE;
+}
+
+/* check which maps of a running exe have actually been touched by its
+ * process, and learn the probability of each of them being used when
+ * the exe runs. */
+static void exe_update_map_prob(preload_exe_t* exe) {
+    GHashTable* used;
+
+    if (!conf->model.usemapprob || !exe->pid)
+        return;
+
+    used = proc_get_maps_usage(exe->pid);
+    if (!used) /* process died or something */
+        return;
+
+    g_set_foreach(exe->exemaps, (GFunc)G_CALLBACK(exemap_update_prob), used);
+    g_hash_table_destroy(used);
+}
+
+static void exemap_save_prob(preload_exemap_t* exemap, GHashTable* probs) {
+    g_hash_table_insert(probs, exemap->map, &exemap->prob);
+}
+
+static void exemap_restore_prob(preload_exemap_t* exemap, GHashTable* probs) {
+    double* prob = g_hash_table_lookup(probs, exemap->map);
+    if (prob)
+        exemap->prob = *prob;
+}
+
+static void exemap_add_size(preload_exemap_t* exemap, preload_exe_t* exe) {
+    exe->size += preload_map_get_size(exemap->map);
+}
+
+/* the files of exe changed since its maps were read, see identity.c.
+ * read them again from its process that just started, keeping what was
+ * learned of the maps that are still there. */
+static void exe_reprobe(preload_exe_t* exe) {
+    GSet* exemaps;
+    GHashTable* probs;
+
+    if (!proc_get_maps(exe->pid, state->maps, &exemaps)) {
+        /* process died or something, try the next one */
+        g_set_foreach(exemaps, (GFunc)G_CALLBACK(preload_exemap_free), NULL);
+        g_set_free(exemaps);
+        return;
+    }
+
+    probs = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_set_foreach(exe->exemaps, (GFunc)G_CALLBACK(exemap_save_prob), probs);
+    g_set_foreach(exemaps, (GFunc)G_CALLBACK(exemap_restore_prob), probs);
+    g_hash_table_destroy(probs);
+
+    /* after the new ones took their references */
+    g_set_foreach(exe->exemaps, (GFunc)G_CALLBACK(preload_exemap_free), NULL);
+    g_set_free(exe->exemaps);
+    exe->exemaps = exemaps;
+    exe->size = 0;
+    g_set_foreach(exe->exemaps, (GFunc)G_CALLBACK(exemap_add_size), exe);
+    exe->reprobe = FALSE;
+    g_debug("learned the maps of %s again", exe->path);
+}
+
 /* there is an exe we've never seen before.  check if it's a piggy one or
- * not.  if yes, add it to the our farm, add it to the blacklist otherwise. */
+ * not.  if yes, add it to the our farm, add it to the blacklist otherwise.
+ * its maps are read once, and only made maps of the model if it is. */
 static void new_exe_callback(char* path, pid_t pid) {
-    gboolean want_it;
+    proc_maps_t* maps = proc_maps_scratch();
     size_t size;
 
-    size = proc_get_maps(pid, NULL, NULL);
+    size = proc_maps_read(maps, pid);
 
     if (!size) /* process died or something */
         return;
 
-    want_it = size >= (size_t)conf->model.minsize;
-
-    if (want_it) {
+    if (size >= (size_t)conf->model.minsize) {
         preload_exe_t* exe;
-        GSet* exemaps;
-
-        size = proc_get_maps(pid, state->maps, &exemaps);
-        if (!size) {
-            /* process just died, clean up */
-            g_set_foreach(exemaps, (GFunc)G_CALLBACK(preload_exemap_free),
-                          NULL);
-            g_set_free(exemaps);
-            return;
-        }
 
-        exe = preload_exe_new(path, TRUE, exemaps);
+        exe = preload_exe_new(path, TRUE,
+                              proc_maps_exemaps(maps, state->maps));
+        exe->pid = pid;
         // NOTE: This wants to create markovs; then the markov should be
         // returned
         preload_state_register_exe(exe, TRUE);
         state->running_exes = g_slist_prepend(state->running_exes, exe);
+        exe_update_map_prob(exe);
     } else {
-        g_hash_table_insert(state->bad_exes, g_strdup(path),
-                            GINT_TO_POINTER(size));
+        preload_state_register_badexe(path, size);
     }
 }
 
@@ -117,21 +237,43 @@ static void running_exe_inc_time(gpointer G_GNUC_UNUSED key,
 /* adjust states on exes that change state (running/not-running) */
 static void exe_changed_callback(preload_exe_t* exe) {
     exe->change_timestamp = state->time;
-    g_set_foreach(exe->markovs,
-                  (GFunc)G_CALLBACK(preload_markov_state_changed), NULL);
+    preload_predictors_exe_changed(exe);
+
+    /* it has been running for half a cycle now, see what it uses */
+    if (exe_is_running(exe)) {
+        if (exe->reprobe)
+            exe_reprobe(exe);
+        exe_update_map_prob(exe);
+    }
 }
 
 void preload_spy_scan(gpointer data) {
     /* scan processes, see which exes started running, which are not running
      * anymore, and what new exes are around. */
 
+    preload_trace_scan(state->time, preload_trace_wallclock());
+
     state_changed_exes = new_running_exes = NULL;
+    g_slist_free(state->launched_exes);
+    state->launched_exes = NULL;
     new_exes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    new_pids =
+        g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    started_pids = NULL;
 
     /* mark each running exe with fresh timestamp */
     proc_foreach((GHFunc)G_CALLBACK(running_process_callback), data);
     state->last_running_timestamp = state->time;
 
+    /* see who spawned the new processes.  nothing is new on the first
+     * scan, running_pids being NULL then. */
+    g_slist_foreach(started_pids, (GFunc)G_CALLBACK(started_pid_callback),
+                    NULL);
+    g_slist_free(started_pids);
+    if (running_pids)
+        g_hash_table_destroy(running_pids);
+    running_pids = new_pids;
+
     /* figure out who's not running by checking their timestamp */
     g_slist_foreach(state->running_exes,
                     (GFunc)G_CALLBACK(already_running_exe_callback), data);
@@ -160,5 +302,12 @@ void preload_spy_update_model(gpointer data) {
                          GINT_TO_POINTER(period));
     preload_markov_foreach((GFunc)G_CALLBACK(running_markov_inc_time),
                            GINT_TO_POINTER(period));
+    preload_predictors_tick(period);
     state->last_accounting_timestamp = state->time;
 }
+
+void preload_spy_free(void) {
+    if (running_pids)
+        g_hash_table_destroy(running_pids);
+    running_pids = NULL;
+}
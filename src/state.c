@@ -26,9 +26,16 @@
 
 #include "common.h"
 #include "conf.h"
+#include "fdcache.h"
+#include "identity.h"
 #include "log.h"
+#include "metrics.h"
+#include "mntns.h"
+#include "predictor.h"
 #include "proc.h"
 #include "prophet.h"
+#include "queue.h"
+#include "readahead.h"
 #include "spy.h"
 
 /* horrible hack to shut the double-declaration of g_snprintf up may
@@ -53,6 +60,12 @@ preload_map_t* preload_map_new(const char* path,
     map->refcount = 0;
     map->update_time = state->time;
     map->block = -1;
+    map->physical = FALSE;
+    map->priv = 0;
+    map->prefetched = map->hits = map->evicted = map->wasted = 0;
+    map->prefetch_time = -1;
+    memset(&map->id, 0, sizeof(map->id));
+    map->check_time = -1;
     return map;
 }
 
@@ -66,6 +79,112 @@ void preload_map_free(preload_map_t* map) {
     g_free(map);
 }
 
+static guint file_hash(const preload_identity_t* id) {
+    return (guint)(id->ino ^ (id->ino >> 32)) ^ (guint)id->dev;
+}
+
+static gboolean file_equal(const preload_identity_t* a,
+                           const preload_identity_t* b) {
+    return a->ino == b->ino && a->dev == b->dev;
+}
+
+/* file_path_t: the path maps of a file go by, in state->files. */
+typedef struct _file_path_t {
+    char* path;
+    int seen;     /* last time the file was seen mapped. */
+    int verified; /* last time it was found still at path, or -1. */
+} file_path_t;
+
+static void file_path_free(file_path_t* file) {
+    g_free(file->path);
+    g_free(file);
+}
+
+const char* preload_state_map_path(guint64 dev,
+                                   guint64 ino,
+                                   const char* path) {
+    preload_identity_t key = {dev, ino, 0, 0};
+    file_path_t* known;
+
+    if (!ino)
+        return path;
+
+    known = g_hash_table_lookup(state->files, &key);
+    if (known && strcmp(known->path, path)) {
+        struct stat buf;
+
+        /* unless the file is gone from there, and its inode reused.  once
+         * a scan is enough, for all the processes mapping it */
+        if (known->verified == state->time ||
+            (0 == stat(known->path, &buf) && buf.st_dev == dev &&
+             buf.st_ino == ino)) {
+            known->seen = known->verified = state->time;
+            return known->path;
+        }
+        known = NULL;
+    }
+    if (!known) {
+        preload_identity_t* id = g_new(preload_identity_t, 1);
+
+        *id = key;
+        known = g_new(file_path_t, 1);
+        known->path = g_strdup(path);
+        known->verified = -1;
+        g_hash_table_insert(state->files, id, known);
+    }
+    known->seen = state->time;
+    return path;
+}
+
+void preload_state_forget_path(guint64 dev, guint64 ino, const char* path) {
+    preload_identity_t key = {dev, ino, 0, 0};
+    const file_path_t* known;
+
+    known = g_hash_table_lookup(state->files, &key);
+    if (known && !strcmp(known->path, path))
+        g_hash_table_remove(state->files, &key);
+}
+
+static void add_map_path(const preload_map_t* map, GHashTable* used) {
+    g_hash_table_insert(used, map->path, GINT_TO_POINTER(-1));
+}
+
+/* the last time a file at each path used was seen */
+static void file_latest_seen(gpointer G_GNUC_UNUSED id,
+                             const file_path_t* file,
+                             GHashTable* used) {
+    gpointer latest;
+
+    if (g_hash_table_lookup_extended(used, file->path, NULL, &latest) &&
+        file->seen > GPOINTER_TO_INT(latest))
+        g_hash_table_insert(used, file->path, GINT_TO_POINTER(file->seen));
+}
+
+static gboolean file_is_unused(gpointer G_GNUC_UNUSED id,
+                               const file_path_t* file,
+                               GHashTable* used) {
+    gpointer latest;
+
+    return !g_hash_table_lookup_extended(used, file->path, NULL, &latest) ||
+           file->seen < GPOINTER_TO_INT(latest);
+}
+
+/* forgets the files that no map goes by the path of, seen in the maps of
+ * exes too small, and the ones replaced since by another file at the
+ * same path.  paths are what the maps know whether or not their files
+ * are checked, see filecheck */
+static void forget_unused_files(void) {
+    GHashTable* used = g_hash_table_new(g_str_hash, g_str_equal);
+
+    g_ptr_array_foreach(state->maps_arr, (GFunc)G_CALLBACK(add_map_path),
+                        used);
+    g_hash_table_foreach(state->files, (GHFunc)G_CALLBACK(file_latest_seen),
+                         used);
+    g_hash_table_foreach_remove(state->files,
+                                (GHRFunc)G_CALLBACK(file_is_unused), used);
+    g_hash_table_destroy(used);
+}
+
 static void preload_state_register_map(preload_map_t* map) {
     g_return_if_fail(!g_hash_table_lookup(state->maps, map));
 
@@ -337,6 +456,7 @@ preload_exe_t* preload_exe_new(const char* path,
     exe->size = 0;
     exe->time = 0;
     exe->change_timestamp = state->time;
+    exe->pid = 0;
     if (running) {
         exe->update_time = exe->running_timestamp =
             state->last_running_timestamp;
@@ -349,6 +469,10 @@ preload_exe_t* preload_exe_new(const char* path,
         exe->exemaps = exemaps;
     g_set_foreach(exe->exemaps, (GFunc)exe_add_map_size, exe);
     exe->markovs = g_set_new();
+    exe->launches = NULL;
+    memset(&exe->id, 0, sizeof(exe->id));
+    exe->reprobe = FALSE;
+    exe->check_time = -1;
     return exe;
 }
 
@@ -362,6 +486,8 @@ void preload_exe_free(preload_exe_t* exe) {
     g_set_foreach(exe->markovs, (GFunc)preload_markov_free, exe);
     g_set_free(exe->markovs);
     exe->markovs = NULL;
+    g_free(exe->launches);
+    exe->launches = NULL;
     g_free(exe->path);
     exe->path = NULL;
     g_free(exe);
@@ -409,12 +535,61 @@ void preload_state_unregister_exe(preload_exe_t* exe) {
     g_hash_table_remove(state->exes, exe);
 }
 
+static preload_badexe_t* badexe_new(int size, int update_time) {
+    preload_badexe_t* badexe = g_new0(preload_badexe_t, 1);
+
+    badexe->size = size;
+    badexe->update_time = update_time;
+    badexe->check_time = -1;
+    badexe->hit_time = -1;
+    return badexe;
+}
+
+static void add_path(char* path,
+                     gpointer G_GNUC_UNUSED value,
+                     GPtrArray* paths) {
+    g_ptr_array_add(paths, path);
+}
+
+/* of the bad exes at paths a and b, the one found earlier first */
+static int compare_badexe_time(const char** a, const char** b) {
+    preload_badexe_t* x = g_hash_table_lookup(state->bad_exes, *a);
+    preload_badexe_t* y = g_hash_table_lookup(state->bad_exes, *b);
+
+    return x->update_time - y->update_time;
+}
+
+void preload_state_register_badexe(const char* path, int size) {
+    guint max = MAX(1, conf->model.badexemax);
+
+    /* make room for a quarter more at once, not to go through them all
+     * for every new one */
+    if (g_hash_table_size(state->bad_exes) >= max) {
+        GPtrArray* paths = g_ptr_array_new();
+        guint keep = max * 3 / 4, i;
+
+        g_hash_table_foreach(state->bad_exes, (GHFunc)G_CALLBACK(add_path),
+                             paths);
+        g_ptr_array_sort(paths, (GCompareFunc)compare_badexe_time);
+        for (i = 0; i + keep < paths->len; i++)
+            g_hash_table_remove(state->bad_exes, g_ptr_array_index(paths, i));
+        g_ptr_array_free(paths, TRUE);
+    }
+
+    g_hash_table_insert(state->bad_exes, g_strdup(path),
+                        badexe_new(size, state->time));
+    state->dirty = TRUE;
+}
+
 #define TAG_PRELOAD "PRELOAD"
 #define TAG_MAP "MAP"
 #define TAG_BADEXE "BADEXE"
 #define TAG_EXE "EXE"
 #define TAG_EXEMAP "EXEMAP"
 #define TAG_MARKOV "MARKOV"
+#define TAG_MAPUSE "MAPUSE"
+#define TAG_MAPID "MAPID"
+#define TAG_EXEID "EXEID"
 
 #define READ_TAG_ERROR "invalid tag"
 #define READ_SYNTAX_ERROR "invalid syntax"
@@ -430,6 +605,7 @@ typedef struct _read_context_t {
     GHashTable* exes;
     gpointer data;
     GError* err;
+    gboolean merged; /* whether maps were, see merge_map */
     char filebuf[FILELEN];
 } read_context_t;
 
@@ -470,17 +646,140 @@ err:
     preload_map_free(map);
 }
 
+static void read_mapuse(read_context_t* rc) {
+    preload_map_t* map;
+    int i, prefetched, hits, evicted, wasted;
+
+    if (5 > sscanf(rc->line, "%d %d %d %d %d", &i, &prefetched, &hits,
+                   &evicted, &wasted)) {
+        rc->errmsg = READ_SYNTAX_ERROR;
+        return;
+    }
+
+    map = g_hash_table_lookup(rc->maps, GINT_TO_POINTER(i));
+    if (!map) {
+        rc->errmsg = READ_INDEX_ERROR;
+        return;
+    }
+
+    map->prefetched = prefetched;
+    map->hits = hits;
+    map->evicted = evicted;
+    map->wasted = wasted;
+}
+
+/* reads "dev ino size mtime" into id.  returns the number of characters
+ * read, or 0 if invalid */
+static int read_identity(const char* line, preload_identity_t* id) {
+    unsigned long long dev, ino;
+    long long size, mtime;
+    int n = 0;
+
+    if (4 > sscanf(line, "%llu %llu %lld %lld%n", &dev, &ino, &size, &mtime,
+                   &n))
+        return 0;
+    id->dev = dev;
+    id->ino = ino;
+    id->size = size;
+    id->mtime = mtime;
+    return n;
+}
+
+/* map is of the same file as maps read already by another path, from
+ * before maps were told apart by file.  makes index i stand for the map
+ * by that path instead, leaving map to be freed */
+static void merge_map(read_context_t* rc,
+                      int i,
+                      preload_map_t* map,
+                      const char* path) {
+    preload_map_t* other = preload_map_new(path, map->offset, map->length);
+    gpointer orig;
+
+    if (g_hash_table_lookup_extended(state->maps, other, &orig, NULL)) {
+        preload_map_free(other);
+        other = orig;
+    } else {
+        other->update_time = map->update_time;
+        other->prefetched = map->prefetched;
+        other->hits = map->hits;
+        other->evicted = map->evicted;
+        other->wasted = map->wasted;
+        other->id = map->id;
+    }
+
+    /* for the index, unreferencing map */
+    preload_map_ref(other);
+    g_hash_table_insert(rc->maps, GINT_TO_POINTER(i), other);
+    rc->merged = TRUE;
+}
+
+static void read_mapid(read_context_t* rc) {
+    preload_map_t* map;
+    const char* path;
+    int i, n = 0;
+
+    if (1 > sscanf(rc->line, "%d%n", &i, &n)) {
+        rc->errmsg = READ_SYNTAX_ERROR;
+        return;
+    }
+
+    map = g_hash_table_lookup(rc->maps, GINT_TO_POINTER(i));
+    if (!map) {
+        rc->errmsg = READ_INDEX_ERROR;
+        return;
+    }
+
+    if (!read_identity(rc->line + n, &map->id)) {
+        rc->errmsg = READ_SYNTAX_ERROR;
+        return;
+    }
+
+    path = preload_state_map_path(map->id.dev, map->id.ino, map->path);
+    if (path != map->path)
+        merge_map(rc, i, map, path);
+}
+
+static void read_exeid(read_context_t* rc) {
+    preload_exe_t* exe;
+    int i, reprobe, n = 0, m;
+
+    if (1 > sscanf(rc->line, "%d%n", &i, &n)) {
+        rc->errmsg = READ_SYNTAX_ERROR;
+        return;
+    }
+
+    exe = g_hash_table_lookup(rc->exes, GINT_TO_POINTER(i));
+    if (!exe) {
+        rc->errmsg = READ_INDEX_ERROR;
+        return;
+    }
+
+    m = read_identity(rc->line + n, &exe->id);
+    if (!m || 1 > sscanf(rc->line + n + m, "%d", &reprobe)) {
+        rc->errmsg = READ_SYNTAX_ERROR;
+        return;
+    }
+    exe->reprobe = reprobe;
+}
+
 static void read_badexe(read_context_t* rc) {
-    int size;
-    int expansion;
+    preload_badexe_t* badexe;
+    preload_identity_t id;
+    int update_time, size, n = 0, m;
     char* path;
 
-    /* we do not read-in badexes.  let's clean them up on every start, give
-     * them another chance! */
-    return;
+    if (2 > sscanf(rc->line, "%d %d%n", &update_time, &size, &n)) {
+        rc->errmsg = READ_SYNTAX_ERROR;
+        return;
+    }
+
+    /* from before they were kept, with no size.  give them another
+     * chance! */
+    if (size < 0)
+        return;
 
-    if (3 > sscanf(rc->line, "%d %d %" FILELENSTR "s", &size, &expansion,
-                   rc->filebuf)) {
+    m = read_identity(rc->line + n, &id);
+    if (!m || 1 > sscanf(rc->line + n + m, "%" FILELENSTR "s", rc->filebuf)) {
         rc->errmsg = READ_SYNTAX_ERROR;
         return;
     }
@@ -489,7 +788,9 @@ static void read_badexe(read_context_t* rc) {
     if (!path)
         return;
 
-    g_hash_table_insert(state->bad_exes, path, GINT_TO_POINTER(size));
+    badexe = badexe_new(size, update_time);
+    badexe->id = id;
+    g_hash_table_insert(state->bad_exes, path, badexe);
 }
 
 static void read_exe(read_context_t* rc) {
@@ -530,6 +831,12 @@ err:
     preload_exe_free(exe);
 }
 
+/* clears *map if exemap is of it */
+static void exemap_find_map(preload_exemap_t* exemap, preload_map_t** map) {
+    if (exemap->map == *map)
+        *map = NULL;
+}
+
 static void read_exemap(read_context_t* rc) {
     int iexe, imap;
     preload_exe_t* exe;
@@ -549,6 +856,14 @@ static void read_exemap(read_context_t* rc) {
         return;
     }
 
+    /* two maps of it were merged into one, see merge_map */
+    if (rc->merged) {
+        g_set_foreach(exe->exemaps, (GFunc)G_CALLBACK(exemap_find_map),
+                      &map);
+        if (!map)
+            return;
+    }
+
     // you could have just passed the prob as a param FFS!
     exemap = preload_exe_map_new(exe, map);
     exemap->prob = prob;
@@ -630,6 +945,7 @@ static char* read_state(GIOChannel* f) {
 
     rc.errmsg = NULL;
     rc.err = NULL;
+    rc.merged = FALSE;
     rc.maps = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
                                     (GDestroyNotify)preload_map_unref);
     rc.exes = g_hash_table_new(g_direct_hash, g_direct_equal);
@@ -696,14 +1012,22 @@ static char* read_state(GIOChannel* f) {
             state->last_accounting_timestamp = state->time = time;
         } else if (!strcmp(tag, TAG_MAP))
             read_map(&rc);
+        else if (!strcmp(tag, TAG_MAPUSE))
+            read_mapuse(&rc);
+        else if (!strcmp(tag, TAG_MAPID))
+            read_mapid(&rc);
         else if (!strcmp(tag, TAG_BADEXE))
             read_badexe(&rc);
         else if (!strcmp(tag, TAG_EXE))
             read_exe(&rc);
+        else if (!strcmp(tag, TAG_EXEID))
+            read_exeid(&rc);
         else if (!strcmp(tag, TAG_EXEMAP))
             read_exemap(&rc);
         else if (!strcmp(tag, TAG_MARKOV))
             read_markov(&rc);
+        else if (preload_predictors_read(tag, rc.line, rc.exes, &rc.errmsg))
+            ;
         else if (linebuf->str[0] && linebuf->str[0] != '#') {
             rc.errmsg = READ_TAG_ERROR;
             break;
@@ -740,10 +1064,14 @@ void preload_state_load(const char* statefile) {
     state->exes = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
                                         (GDestroyNotify)preload_exe_free);
     state->bad_exes =
-        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
     state->maps = g_hash_table_new((GHashFunc)preload_map_hash,
                                    (GEqualFunc)preload_map_equal);
     state->maps_arr = g_ptr_array_new();
+    state->files = g_hash_table_new_full((GHashFunc)file_hash,
+                                         (GEqualFunc)file_equal, g_free,
+                                         (GDestroyNotify)file_path_free);
+    preload_predictors_init();
 
     if (statefile && *statefile) {
         GIOChannel* f;
@@ -821,7 +1149,39 @@ static void write_map(preload_map_t* map,
     g_free(uri);
 }
 
-static void write_badexe(char* path, int update_time, write_context_t* wc) {
+/* only for maps ever prefetched, most are not */
+static void write_mapuse(preload_map_t* map,
+                         gpointer G_GNUC_UNUSED data,
+                         write_context_t* wc) {
+    if (!map->prefetched)
+        return;
+
+    write_tag(TAG_MAPUSE);
+    g_string_printf(wc->line, "%d\t%d\t%d\t%d\t%d", map->seq, map->prefetched,
+                    map->hits, map->evicted, map->wasted);
+    write_string(wc->line);
+    write_ln();
+}
+
+/* only for those checked already */
+static void write_mapid(preload_map_t* map,
+                        gpointer G_GNUC_UNUSED data,
+                        write_context_t* wc) {
+    if (!map->id.ino)
+        return;
+
+    write_tag(TAG_MAPID);
+    g_string_printf(wc->line, "%d\t%llu\t%llu\t%lld\t%lld", map->seq,
+                    (unsigned long long)map->id.dev,
+                    (unsigned long long)map->id.ino, (long long)map->id.size,
+                    (long long)map->id.mtime);
+    write_string(wc->line);
+    write_ln();
+}
+
+static void write_badexe(char* path,
+                         preload_badexe_t* badexe,
+                         write_context_t* wc) {
     char* uri;
 
     uri = g_filename_to_uri(path, NULL, &(wc->err));
@@ -829,7 +1189,11 @@ static void write_badexe(char* path, int update_time, write_context_t* wc) {
         return;
 
     write_tag(TAG_BADEXE);
-    g_string_printf(wc->line, "%d\t%d\t%s", update_time, -1 /*expansion*/,
+    g_string_printf(wc->line, "%d\t%d\t%llu\t%llu\t%lld\t%lld\t%s",
+                    badexe->update_time, badexe->size,
+                    (unsigned long long)badexe->id.dev,
+                    (unsigned long long)badexe->id.ino,
+                    (long long)badexe->id.size, (long long)badexe->id.mtime,
                     uri);
     write_string(wc->line);
     write_ln();
@@ -856,6 +1220,21 @@ static void write_exe(gpointer G_GNUC_UNUSED key,
     g_free(uri);
 }
 
+static void write_exeid(gpointer G_GNUC_UNUSED key,
+                        preload_exe_t* exe,
+                        write_context_t* wc) {
+    if (!exe->id.ino && !exe->reprobe)
+        return;
+
+    write_tag(TAG_EXEID);
+    g_string_printf(wc->line, "%d\t%llu\t%llu\t%lld\t%lld\t%d", exe->seq,
+                    (unsigned long long)exe->id.dev,
+                    (unsigned long long)exe->id.ino, (long long)exe->id.size,
+                    (long long)exe->id.mtime, exe->reprobe);
+    write_string(wc->line);
+    write_ln();
+}
+
 static void write_exemap(preload_exemap_t* exemap,
                          preload_exe_t* exe,
                          write_context_t* wc) {
@@ -889,6 +1268,12 @@ static void write_markov(preload_markov_t* markov, write_context_t* wc) {
     write_ln();
 }
 
+static void write_predictors(write_context_t* wc) {
+    g_string_truncate(wc->line, 0);
+    preload_predictors_write(wc->line);
+    write_string(wc->line);
+}
+
 static char* write_state(GIOChannel* f) {
     write_context_t wc;
 
@@ -900,6 +1285,10 @@ static char* write_state(GIOChannel* f) {
     // NOTE: value not used
     if (!wc.err)
         g_hash_table_foreach(state->maps, (GHFunc)write_map, &wc);
+    if (!wc.err)
+        g_hash_table_foreach(state->maps, (GHFunc)write_mapuse, &wc);
+    if (!wc.err)
+        g_hash_table_foreach(state->maps, (GHFunc)write_mapid, &wc);
 
     // NOTE: Both k, v used
     if (!wc.err)
@@ -909,10 +1298,14 @@ static char* write_state(GIOChannel* f) {
     // NOTE: value used; key unused
     if (!wc.err)
         g_hash_table_foreach(state->exes, (GHFunc)write_exe, &wc);
+    if (!wc.err)
+        g_hash_table_foreach(state->exes, (GHFunc)write_exeid, &wc);
     if (!wc.err)
         preload_exemap_foreach((GHFunc)write_exemap, &wc);
     if (!wc.err)
         preload_markov_foreach((GFunc)write_markov, &wc);
+    if (!wc.err)
+        write_predictors(&wc);
 
     g_string_free(wc.line, TRUE);
     if (wc.err) {
@@ -924,8 +1317,10 @@ static char* write_state(GIOChannel* f) {
         return NULL;
 }
 
-static gboolean true_func(void) {
-    return TRUE;
+static gboolean badexe_is_expired(gpointer G_GNUC_UNUSED path,
+                                  preload_badexe_t* badexe) {
+    return conf->model.badexettl <= 0 ||
+           state->time - badexe->update_time >= conf->model.badexettl;
 }
 
 void preload_state_save(const char* statefile) {
@@ -935,6 +1330,7 @@ void preload_state_save(const char* statefile) {
         char* tmpfile;
 
         g_message("saving state to %s", statefile);
+        preload_metrics_begin(METRIC_PHASE_SAVE);
 
         tmpfile = g_strconcat(statefile, ".tmp", NULL);
         g_debug("to be honest, saving state to %s", tmpfile);
@@ -971,16 +1367,25 @@ void preload_state_save(const char* statefile) {
 
         state->dirty = FALSE;
 
+        preload_metrics_end(METRIC_PHASE_SAVE);
         g_debug("saving state done");
     }
 
-    /* clean up bad exes once in a while */
+    /* give bad exes another chance once in a while */
     g_hash_table_foreach_remove(state->bad_exes,
-                                (GHRFunc)G_CALLBACK(true_func), NULL);
+                                (GHRFunc)G_CALLBACK(badexe_is_expired), NULL);
+    forget_unused_files();
 }
 
 void preload_state_free(void) {
     g_message("freeing state memory begin");
+    preload_predictors_free();
+    preload_spy_free();
+    preload_queue_free();
+    preload_fdcache_free();
+    preload_identity_free();
+    preload_mntns_free();
+    proc_maps_scratch_free();
     g_hash_table_destroy(state->bad_exes);
     state->bad_exes = NULL;
     g_hash_table_destroy(state->exes);
@@ -991,20 +1396,37 @@ void preload_state_free(void) {
     state->maps = NULL;
     g_slist_free(state->running_exes);
     state->running_exes = NULL;
+    g_slist_free(state->launched_exes);
+    state->launched_exes = NULL;
     g_ptr_array_free(state->maps_arr, TRUE);
+    g_hash_table_destroy(state->files);
+    state->files = NULL;
     g_debug("freeing state memory done");
 }
 
+static void map_sum_use(preload_map_t* map, int* sums) {
+    sums[0] += map->prefetched;
+    sums[1] += map->hits;
+    sums[2] += map->evicted;
+    sums[3] += map->wasted;
+}
+
 void preload_state_dump_log(void) {
+    int sums[4] = {0, 0, 0, 0};
+
     g_message("state log dump requested");
+    g_ptr_array_foreach(state->maps_arr, (GFunc)G_CALLBACK(map_sum_use), sums);
     fprintf(stderr, "persistent state stats:\n");
     fprintf(stderr, "preload time = %d\n", state->time);
     fprintf(stderr, "num exes = %d\n", g_hash_table_size(state->exes));
     fprintf(stderr, "num bad exes = %d\n", g_hash_table_size(state->bad_exes));
     fprintf(stderr, "num maps = %d\n", g_hash_table_size(state->maps));
+    fprintf(stderr, "maps prefetched = %d (hits %d, evicted %d, wasted %d)\n",
+            sums[0], sums[1], sums[2], sums[3]);
     fprintf(stderr, "runtime state stats:\n");
     fprintf(stderr, "num running exes = %d\n",
             g_slist_length(state->running_exes));
+    preload_readahead_dump_log();
     g_debug("state log dump done");
 }
 
@@ -1018,11 +1440,22 @@ static gboolean preload_state_tick(gpointer data);
 static gboolean preload_state_tick2(gpointer data) {
     if (state->model_dirty) {
         g_debug("state updating begin");
+        preload_metrics_begin(METRIC_PHASE_UPDATE);
         preload_spy_update_model(data);
+        preload_metrics_end(METRIC_PHASE_UPDATE);
         state->model_dirty = FALSE;
         g_debug("state updating end");
     }
 
+    preload_identity_check();
+    preload_fdcache_expire();
+
+    preload_metrics_set(METRIC_EXES, g_hash_table_size(state->exes));
+    preload_metrics_set(METRIC_BAD_EXES, g_hash_table_size(state->bad_exes));
+    preload_metrics_set(METRIC_MAPS_KNOWN, g_hash_table_size(state->maps));
+    preload_metrics_set(METRIC_RUNNING, g_slist_length(state->running_exes));
+    preload_metrics_write();
+
     /* increase time and reschedule */
     state->time += (conf->model.cycle + 1) / 2;
     g_timeout_add_seconds((conf->model.cycle + 1) / 2, preload_state_tick,
@@ -1033,7 +1466,9 @@ static gboolean preload_state_tick2(gpointer data) {
 static gboolean preload_state_tick(gpointer data) {
     if (conf->system.doscan) {
         g_debug("state scanning begin");
+        preload_metrics_begin(METRIC_PHASE_SCAN);
         preload_spy_scan(data);
+        preload_metrics_end(METRIC_PHASE_SCAN);
         if (preload_is_debugging())
             preload_state_dump_log();
         state->dirty = state->model_dirty = TRUE;
@@ -1041,7 +1476,9 @@ static gboolean preload_state_tick(gpointer data) {
     }
     if (conf->system.dopredict) {
         g_debug("state predicting begin");
+        preload_metrics_begin(METRIC_PHASE_PREDICT);
         preload_prophet_predict(data);
+        preload_metrics_end(METRIC_PHASE_PREDICT);
         g_debug("state predicting end");
     }
 
@@ -0,0 +1,512 @@
+/* trace.c - preload scan trace recording and replaying
+ *
+ * This file is part of preload.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "trace.h"
+
+#include "common.h"
+#include "log.h"
+
+/* The file starts with TRACE_MAGIC and a 32-bit version, followed by
+ * records, each being a type byte and its fields, in host byte order:
+ *
+ *   PATH    id:u32 len:u16 bytes        path ids are assigned 0, 1, ...
+ *   SCAN    time:i32 wallclock:i64      starts the records of a scan
+ *   PROC    pid:i32 path:u32
+ *   STAT    pid:i32 ppid:i32 starttime:f64
+ *   MAPS    pid:i32 n:u32 n*(path:u32 offset:u64 length:u64)
+ *   USAGE   same as MAPS
+ *   MEMSTAT total free buffers cached pagein pageout, all i32
+ *
+ * Paths are written once and referred to by id afterwards, which keeps
+ * the maps of the same libraries showing up over and over cheap. */
+
+#define TRACE_MAGIC "PRELOADTRACE"
+#define TRACE_VERSION 1
+
+enum {
+    TRACE_PATH = 'P',
+    TRACE_SCAN = 'S',
+    TRACE_PROC = 'p',
+    TRACE_STAT = 't',
+    TRACE_MAPS = 'm',
+    TRACE_USAGE = 'u',
+    TRACE_MEMSTAT = 'M',
+};
+
+typedef struct _trace_map_t {
+    guint32 path;
+    guint64 offset;
+    guint64 length;
+} trace_map_t;
+
+typedef struct _trace_stat_t {
+    gint32 ppid;
+    double starttime;
+} trace_stat_t;
+
+/* recording */
+
+static FILE* out;
+static GHashTable* out_paths; /* path -> id + 1 */
+static GString* out_rec;      /* record being built */
+static GString* out_maps;     /* maps record being built */
+static guint32 out_maps_count;
+static GHashTable* out_maps_seen; /* pid, usage pairs recorded this scan */
+
+#define put(buf, v) g_string_append_len((buf), (const char*)&(v), sizeof(v))
+
+static void out_flush(GString* buf) {
+    if (out && buf->len && 1 != fwrite(buf->str, buf->len, 1, out)) {
+        g_warning("failed writing trace, stopping: %s", strerror(errno));
+        preload_trace_close();
+    }
+    g_string_truncate(buf, 0);
+}
+
+static guint32 out_path(const char* path) {
+    gpointer id;
+    guint32 i;
+    guint16 len;
+    char type = TRACE_PATH;
+
+    id = g_hash_table_lookup(out_paths, path);
+    if (id)
+        return GPOINTER_TO_UINT(id) - 1;
+
+    i = g_hash_table_size(out_paths);
+    g_hash_table_insert(out_paths, g_strdup(path), GUINT_TO_POINTER(i + 1));
+
+    len = strlen(path);
+    put(out_rec, type);
+    put(out_rec, i);
+    put(out_rec, len);
+    g_string_append_len(out_rec, path, len);
+    out_flush(out_rec);
+    return i;
+}
+
+gboolean preload_trace_open(const char* tracefile) {
+    guint32 version = TRACE_VERSION;
+
+    g_return_val_if_fail(!out, FALSE);
+
+    out = fopen(tracefile, "wb");
+    if (!out) {
+        g_warning("cannot open %s for writing: %s", tracefile,
+                  strerror(errno));
+        return FALSE;
+    }
+
+    out_paths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    out_maps_seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+    out_rec = g_string_new(NULL);
+    out_maps = g_string_new(NULL);
+
+    g_string_append_len(out_rec, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    put(out_rec, version);
+    out_flush(out_rec);
+
+    g_message("recording trace to %s", tracefile);
+    return out != NULL;
+}
+
+void preload_trace_close(void) {
+    if (!out)
+        return;
+
+    fclose(out);
+    out = NULL;
+    g_hash_table_destroy(out_paths);
+    g_hash_table_destroy(out_maps_seen);
+    g_string_free(out_rec, TRUE);
+    g_string_free(out_maps, TRUE);
+}
+
+void preload_trace_scan(int time, time_t wallclock) {
+    char type = TRACE_SCAN;
+    gint32 t = time;
+    gint64 w = wallclock;
+
+    if (!out)
+        return;
+
+    g_hash_table_remove_all(out_maps_seen);
+
+    put(out_rec, type);
+    put(out_rec, t);
+    put(out_rec, w);
+    out_flush(out_rec);
+
+    /* flush what we have, so the trace survives a crash */
+    if (out)
+        fflush(out);
+}
+
+void preload_trace_proc(pid_t pid, const char* path) {
+    char type = TRACE_PROC;
+    gint32 p = pid;
+    guint32 id;
+
+    if (!out)
+        return;
+
+    id = out_path(path);
+    put(out_rec, type);
+    put(out_rec, p);
+    put(out_rec, id);
+    out_flush(out_rec);
+}
+
+void preload_trace_stat(pid_t pid, pid_t ppid, double starttime) {
+    char type = TRACE_STAT;
+    gint32 p = pid, pp = ppid;
+
+    if (!out)
+        return;
+
+    put(out_rec, type);
+    put(out_rec, p);
+    put(out_rec, pp);
+    put(out_rec, starttime);
+    out_flush(out_rec);
+}
+
+void preload_trace_memstat(const preload_memory_t* mem) {
+    char type = TRACE_MEMSTAT;
+    gint32 v[6];
+
+    if (!out)
+        return;
+
+    v[0] = mem->total;
+    v[1] = mem->free_;
+    v[2] = mem->buffers;
+    v[3] = mem->cached;
+    v[4] = mem->pagein;
+    v[5] = mem->pageout;
+    put(out_rec, type);
+    put(out_rec, v);
+    out_flush(out_rec);
+}
+
+void preload_trace_maps_begin(pid_t pid, gboolean usage) {
+    char type = usage ? TRACE_USAGE : TRACE_MAPS;
+    gint32 p = pid;
+    gpointer key = GINT_TO_POINTER(pid * 2 + !!usage);
+
+    if (!out)
+        return;
+
+    g_string_truncate(out_maps, 0);
+    out_maps_count = 0;
+
+    /* new exes get their maps read twice in a row, once is enough */
+    if (g_hash_table_lookup(out_maps_seen, key))
+        return;
+    g_hash_table_insert(out_maps_seen, key, key);
+
+    put(out_maps, type);
+    put(out_maps, p);
+    put(out_maps, out_maps_count); /* patched in maps_end */
+}
+
+void preload_trace_map(const char* path, size_t offset, size_t length) {
+    trace_map_t m;
+
+    if (!out || !out_maps->len)
+        return;
+
+    m.path = out_path(path);
+    m.offset = offset;
+    m.length = length;
+    put(out_maps, m.path);
+    put(out_maps, m.offset);
+    put(out_maps, m.length);
+    out_maps_count++;
+}
+
+void preload_trace_maps_end(void) {
+    if (!out || !out_maps->len)
+        return;
+
+    memcpy(out_maps->str + 1 + sizeof(gint32), &out_maps_count,
+           sizeof(out_maps_count));
+    out_flush(out_maps);
+}
+
+/* replaying */
+
+static FILE* in;
+static const preload_trace_hooks_t* in_hooks;
+static GPtrArray* in_paths;       /* id -> path */
+static GArray* in_procs;          /* pid, path id pairs of this scan */
+static GHashTable* in_maps;       /* pid -> GArray of trace_map_t */
+static GHashTable* in_usage;      /* pid -> GArray of trace_map_t */
+static GHashTable* in_stats;      /* pid -> trace_stat_t */
+static preload_memory_t in_mem;   /* last recorded */
+static gint64 in_wallclock;       /* of the current scan */
+static int in_next = EOF;         /* type of the next record */
+
+#define get(v) (1 == fread(&(v), sizeof(v), 1, in))
+
+static void free_maps(GArray* maps) {
+    g_array_free(maps, TRUE);
+}
+
+static void in_next_type(void) {
+    in_next = fgetc(in);
+}
+
+gboolean preload_trace_replay_open(const char* tracefile,
+                                   const preload_trace_hooks_t* hooks) {
+    char magic[sizeof(TRACE_MAGIC)];
+    guint32 version;
+
+    g_return_val_if_fail(!in, FALSE);
+
+    in = fopen(tracefile, "rb");
+    if (!in) {
+        g_warning("cannot open %s for reading: %s", tracefile,
+                  strerror(errno));
+        return FALSE;
+    }
+
+    if (!get(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) ||
+        !get(version) || version != TRACE_VERSION) {
+        g_warning("%s is not a preload trace, or of another version",
+                  tracefile);
+        fclose(in);
+        in = NULL;
+        return FALSE;
+    }
+
+    in_hooks = hooks;
+    in_paths = g_ptr_array_new_with_free_func(g_free);
+    in_procs = g_array_new(FALSE, FALSE, sizeof(gint32) * 2);
+    in_maps = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                    (GDestroyNotify)free_maps);
+    in_usage = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                     (GDestroyNotify)free_maps);
+    in_stats = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                     g_free);
+    memset(&in_mem, 0, sizeof(in_mem));
+    in_next_type();
+    return TRUE;
+}
+
+void preload_trace_replay_close(void) {
+    if (!in)
+        return;
+
+    fclose(in);
+    in = NULL;
+    in_hooks = NULL;
+    g_ptr_array_free(in_paths, TRUE);
+    g_array_free(in_procs, TRUE);
+    g_hash_table_destroy(in_maps);
+    g_hash_table_destroy(in_usage);
+    g_hash_table_destroy(in_stats);
+}
+
+static gboolean read_path(void) {
+    guint32 id;
+    guint16 len;
+    char* path;
+
+    if (!get(id) || !get(len) || id != in_paths->len)
+        return FALSE;
+
+    path = g_malloc(len + 1);
+    if (len && 1 != fread(path, len, 1, in)) {
+        g_free(path);
+        return FALSE;
+    }
+    path[len] = '\0';
+    g_ptr_array_add(in_paths, path);
+    return TRUE;
+}
+
+static gboolean read_maps(GHashTable* table) {
+    gint32 pid;
+    guint32 n, i;
+    GArray* maps;
+
+    if (!get(pid) || !get(n))
+        return FALSE;
+
+    maps = g_array_sized_new(FALSE, FALSE, sizeof(trace_map_t), n);
+    for (i = 0; i < n; i++) {
+        trace_map_t m;
+        if (!get(m.path) || !get(m.offset) || !get(m.length) ||
+            m.path >= in_paths->len) {
+            free_maps(maps);
+            return FALSE;
+        }
+        g_array_append_val(maps, m);
+    }
+
+    g_hash_table_insert(table, GINT_TO_POINTER(pid), maps);
+    return TRUE;
+}
+
+static gboolean read_record(int type) {
+    switch (type) {
+        case TRACE_PATH:
+            return read_path();
+
+        case TRACE_PROC: {
+            gint32 proc[2];
+            if (!get(proc) || (guint32)proc[1] >= in_paths->len)
+                return FALSE;
+            g_array_append_val(in_procs, proc);
+            return TRUE;
+        }
+
+        case TRACE_STAT: {
+            gint32 pid;
+            trace_stat_t* stat = g_new(trace_stat_t, 1);
+            if (!get(pid) || !get(stat->ppid) || !get(stat->starttime)) {
+                g_free(stat);
+                return FALSE;
+            }
+            g_hash_table_insert(in_stats, GINT_TO_POINTER(pid), stat);
+            return TRUE;
+        }
+
+        case TRACE_MAPS:
+            return read_maps(in_maps);
+
+        case TRACE_USAGE:
+            return read_maps(in_usage);
+
+        case TRACE_MEMSTAT: {
+            gint32 v[6];
+            if (!get(v))
+                return FALSE;
+            in_mem.total = v[0];
+            in_mem.free_ = v[1];
+            in_mem.buffers = v[2];
+            in_mem.cached = v[3];
+            in_mem.pagein = v[4];
+            in_mem.pageout = v[5];
+            return TRUE;
+        }
+
+        default:
+            return FALSE;
+    }
+}
+
+gboolean preload_trace_replay_step(int* time) {
+    gint32 t;
+
+    g_return_val_if_fail(in, FALSE);
+
+    /* whatever precedes the first scan is paths and the like */
+    while (in_next != EOF && in_next != TRACE_SCAN) {
+        if (!read_record(in_next))
+            goto corrupt;
+        in_next_type();
+    }
+    if (in_next == EOF)
+        return FALSE;
+
+    if (!get(t) || !get(in_wallclock))
+        goto corrupt;
+    *time = t;
+
+    g_array_set_size(in_procs, 0);
+    g_hash_table_remove_all(in_maps);
+    g_hash_table_remove_all(in_usage);
+    g_hash_table_remove_all(in_stats);
+
+    for (in_next_type(); in_next != EOF && in_next != TRACE_SCAN;
+         in_next_type()) {
+        if (!read_record(in_next))
+            goto corrupt;
+    }
+
+    return TRUE;
+
+corrupt:
+    g_warning("trace is truncated or corrupt, stopping replay");
+    in_next = EOF;
+    return FALSE;
+}
+
+gboolean preload_trace_replaying(void) {
+    return in != NULL;
+}
+
+const preload_trace_hooks_t* preload_trace_replay_hooks(void) {
+    return in_hooks;
+}
+
+void preload_trace_replay_foreach(preload_trace_proc_func_t func,
+                                  gpointer user_data) {
+    guint i;
+
+    for (i = 0; i < in_procs->len; i++) {
+        gint32* proc = &g_array_index(in_procs, gint32, 2 * i);
+        func(proc[0], g_ptr_array_index(in_paths, proc[1]), user_data);
+    }
+}
+
+gboolean preload_trace_replay_maps(pid_t pid,
+                                   gboolean usage,
+                                   preload_trace_map_func_t func,
+                                   gpointer user_data) {
+    GArray* maps;
+    guint i;
+
+    maps = g_hash_table_lookup(usage ? in_usage : in_maps,
+                               GINT_TO_POINTER(pid));
+    if (!maps)
+        return FALSE;
+
+    for (i = 0; i < maps->len; i++) {
+        trace_map_t* m = &g_array_index(maps, trace_map_t, i);
+        func(g_ptr_array_index(in_paths, m->path), m->offset, m->length,
+             user_data);
+    }
+    return TRUE;
+}
+
+gboolean preload_trace_replay_stat(pid_t pid, pid_t* ppid, double* starttime) {
+    trace_stat_t* stat;
+
+    stat = g_hash_table_lookup(in_stats, GINT_TO_POINTER(pid));
+    if (!stat)
+        return FALSE;
+
+    if (ppid)
+        *ppid = stat->ppid;
+    if (starttime)
+        *starttime = stat->starttime;
+    return TRUE;
+}
+
+void preload_trace_replay_memstat(preload_memory_t* mem) {
+    memcpy(mem, &in_mem, sizeof(*mem));
+}
+
+time_t preload_trace_wallclock(void) {
+    return in ? (time_t)in_wallclock : time(NULL);
+}
@@ -0,0 +1,369 @@
+/* coldstart.c - measure cold start latency, with and without readahead
+ *
+ * This file is part of preload.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+/* Launches a command over and over from a cold page cache, and reports
+ * how long it took to exit, and how many major faults it took, under
+ * each readahead configuration asked for.
+ *
+ * The files to prefetch are what the daemon would predict for the
+ * command: its binary and the libraries the dynamic loader maps for it,
+ * as listed by the loader itself, plus any given with -f.  Before every
+ * launch they are evicted with POSIX_FADV_DONTNEED, which needs no
+ * privileges but only drops pages nobody else has mapped; then, unless
+ * the configuration is "off", read in by preload_readahead with the
+ * configuration's sortstrategy and maxprocs.  Configurations take turns
+ * within every round, so that drifts of the machine affect all alike. */
+
+#include <getopt.h>
+#include <math.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "common.h"
+#include "conf.h"
+#include "log.h"
+#include "readahead.h"
+#include "state.h"
+
+static const char* sorts[] = {"none", "path", "inode", "block", "auto"};
+
+typedef struct _config_t {
+    char* name;
+    int sortstrategy; /* -1 for no readahead at all */
+    int maxprocs;
+    GArray* launch;    /* ms, from fork to exit */
+    GArray* readahead; /* ms */
+    GArray* majflt;
+} config_t;
+
+static GPtrArray* files; /* of preload_map_t */
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_file(const char* path) {
+    struct stat buf;
+    guint i;
+
+    if (0 > stat(path, &buf) || !S_ISREG(buf.st_mode) || !buf.st_size) {
+        fprintf(stderr, "ignoring %s\n", path);
+        return;
+    }
+    for (i = 0; i < files->len; i++)
+        if (!strcmp(((preload_map_t*)g_ptr_array_index(files, i))->path, path))
+            return;
+    g_ptr_array_add(files, preload_map_new(path, 0, buf.st_size));
+}
+
+/* the loader lists what it would map when LD_TRACE_LOADED_OBJECTS is set,
+ * that is how ldd works.  lines are "name => path (address)", or
+ * "path (address)" for the loader itself. */
+static void add_loaded_objects(char** argv) {
+    char** env = g_environ_setenv(g_get_environ(), "LD_TRACE_LOADED_OBJECTS",
+                                  "1", TRUE);
+    char* out = NULL;
+    char** lines;
+    char** line;
+
+    if (!g_spawn_sync(NULL, argv, env, G_SPAWN_SEARCH_PATH, NULL, NULL, &out,
+                      NULL, NULL, NULL)) {
+        fprintf(stderr, "cannot list the libraries of %s\n", argv[0]);
+        g_strfreev(env);
+        return;
+    }
+    g_strfreev(env);
+
+    lines = g_strsplit(out, "\n", 0);
+    for (line = lines; *line; line++) {
+        char* p = strstr(*line, "=> ");
+        char* end;
+
+        p = p ? p + 3 : g_strchug(*line);
+        if (*p != '/')
+            continue;
+        end = strstr(p, " (");
+        if (end)
+            *end = '\0';
+        add_file(p);
+    }
+    g_strfreev(lines);
+    g_free(out);
+}
+
+/* returns how many of the files are still cached */
+static int evict(void) {
+    int cached = 0;
+    guint i;
+
+    for (i = 0; i < files->len; i++) {
+        preload_map_t* map = g_ptr_array_index(files, i);
+        int fd = open(map->path, O_RDONLY);
+
+        if (fd < 0)
+            continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+        if (preload_readahead_is_cached(map))
+            cached++;
+    }
+    return cached;
+}
+
+static void run(config_t* config, char** argv) {
+    double start, ms;
+    struct rusage usage;
+    int status;
+    pid_t pid;
+
+    if (config->sortstrategy >= 0) {
+        guint i;
+
+        conf->system.sortstrategy = config->sortstrategy;
+        conf->system.maxprocs = config->maxprocs;
+        /* as fresh from the model */
+        for (i = 0; i < files->len; i++)
+            ((preload_map_t*)g_ptr_array_index(files, i))->block = -1;
+
+        start = now();
+        preload_readahead((preload_map_t**)files->pdata, files->len);
+        ms = 1000 * (now() - start);
+        g_array_append_val(config->readahead, ms);
+    }
+
+    start = now();
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (!pid) {
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, 0);
+        dup2(null, 1);
+        dup2(null, 2);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    if (0 > wait4(pid, &status, 0, &usage)) {
+        perror("wait4");
+        exit(EXIT_FAILURE);
+    }
+    ms = 1000 * (now() - start);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) == 127)
+        fprintf(stderr, "warning: %s did not exit normally\n", argv[0]);
+    g_array_append_val(config->launch, ms);
+    ms = usage.ru_majflt;
+    g_array_append_val(config->majflt, ms);
+}
+
+static int compare_double(const double* a, const double* b) {
+    return *a < *b ? -1 : *a > *b;
+}
+
+/* value at percent p of the sorted samples */
+static double percentile(GArray* samples, int p) {
+    if (!samples->len)
+        return NAN;
+    return g_array_index(samples, double, (samples->len - 1) * p / 100);
+}
+
+static double mean(GArray* samples) {
+    double sum = 0;
+    guint i;
+
+    for (i = 0; i < samples->len; i++)
+        sum += g_array_index(samples, double, i);
+    return samples->len ? sum / samples->len : NAN;
+}
+
+static void report(config_t* config, gboolean json) {
+    g_array_sort(config->launch, (GCompareFunc)compare_double);
+
+    if (json) {
+        printf("{\"config\": \"%s\", \"runs\": %u, \"launch_ms\": {\"min\": "
+               "%.2lf, \"p50\": %.2lf, \"p90\": %.2lf, \"max\": %.2lf}, "
+               "\"majflt\": %.1lf, \"readahead_ms\": %.2lf}\n",
+               config->name, config->launch->len,
+               percentile(config->launch, 0), percentile(config->launch, 50),
+               percentile(config->launch, 90), percentile(config->launch, 100),
+               mean(config->majflt),
+               config->readahead->len ? mean(config->readahead) : 0);
+        return;
+    }
+
+    printf("%-14s %8.2lf %8.2lf %8.2lf %8.2lf %8.1lf %10.2lf\n", config->name,
+           percentile(config->launch, 0), percentile(config->launch, 50),
+           percentile(config->launch, 90), percentile(config->launch, 100),
+           mean(config->majflt),
+           config->readahead->len ? mean(config->readahead) : 0);
+}
+
+static config_t* config_new(const char* name, int sortstrategy, int maxprocs) {
+    config_t* config = g_new(config_t, 1);
+
+    config->name = g_strdup(name);
+    config->sortstrategy = sortstrategy;
+    config->maxprocs = maxprocs;
+    config->launch = g_array_new(FALSE, FALSE, sizeof(double));
+    config->readahead = g_array_new(FALSE, FALSE, sizeof(double));
+    config->majflt = g_array_new(FALSE, FALSE, sizeof(double));
+    return config;
+}
+
+static void config_free(config_t* config) {
+    g_free(config->name);
+    g_array_free(config->launch, TRUE);
+    g_array_free(config->readahead, TRUE);
+    g_array_free(config->majflt, TRUE);
+    g_free(config);
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [-c conffile] [-n runs] [-s sorts] [-m maxprocs] "
+            "[-f file]... [-j] command [arg]...\n"
+            "  -s sorts     sortstrategies to try, of none, path, inode, "
+            "block and auto\n"
+            "  -m maxprocs  reader process counts to try, 0 to read in "
+            "process\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+    const char* conffile = NULL;
+    const char* sort_list = "none,path,block";
+    const char* procs_list = "0,30";
+    const char* prog = argv[0];
+    gboolean json = FALSE;
+    GSList *extra = NULL, *l;
+    int runs = 10;
+    GPtrArray* configs;
+    char **sort_names, **procs, **s, **p;
+    guint i;
+    int r, cached = 0;
+
+    for (;;) {
+        /* + stops at the command, whose options are its own */
+        int c = getopt(argc, argv, "+c:n:s:m:f:j");
+        if (c == -1)
+            break;
+        switch (c) {
+            case 'c':
+                conffile = optarg;
+                break;
+            case 'n':
+                runs = strtol(optarg, NULL, 10);
+                break;
+            case 's':
+                sort_list = optarg;
+                break;
+            case 'm':
+                procs_list = optarg;
+                break;
+            case 'f':
+                extra = g_slist_append(extra, optarg);
+                break;
+            case 'j':
+                json = TRUE;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind >= argc || runs <= 0)
+        usage(argv[0]);
+    argv += optind;
+
+    /* warnings and worse only */
+    preload_log_level = 2;
+    preload_log_init(NULL);
+    preload_conf_load(conffile, TRUE);
+    preload_state_load(NULL);
+
+    files = g_ptr_array_new();
+    {
+        char* path = g_find_program_in_path(argv[0]);
+        if (!path) {
+            fprintf(stderr, "%s: command not found\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        add_file(path);
+        g_free(path);
+    }
+    add_loaded_objects(argv);
+    for (l = extra; l; l = l->next)
+        add_file(l->data);
+    g_slist_free(extra);
+
+    configs = g_ptr_array_new_with_free_func((GDestroyNotify)config_free);
+    g_ptr_array_add(configs, config_new("off", -1, 0));
+    sort_names = g_strsplit(sort_list, ",", 0);
+    procs = g_strsplit(procs_list, ",", 0);
+    for (s = sort_names; *s; s++) {
+        int sort = -1;
+
+        for (i = 0; i < G_N_ELEMENTS(sorts); i++)
+            if (!strcmp(*s, sorts[i]))
+                sort = i;
+        if (sort < 0)
+            usage(prog);
+
+        for (p = procs; *p; p++) {
+            char* name = g_strdup_printf("%s/%s", *s, *p);
+            g_ptr_array_add(configs,
+                            config_new(name, sort, strtol(*p, NULL, 10)));
+            g_free(name);
+        }
+    }
+    g_strfreev(sort_names);
+    g_strfreev(procs);
+
+    for (r = 0; r < runs; r++)
+        for (i = 0; i < configs->len; i++) {
+            cached += evict();
+            run(g_ptr_array_index(configs, i), argv);
+        }
+
+    if (!json) {
+        printf("# %s: %u files, %d runs, launch times in ms\n", argv[0],
+               files->len, runs);
+        if (cached)
+            printf("# warning: %.1f files on average stayed cached after "
+                   "eviction, results are optimistic\n",
+                   (double)cached / (runs * configs->len));
+        printf("%-14s %8s %8s %8s %8s %8s %10s\n", "config", "min", "p50",
+               "p90", "max", "majflt", "readahead");
+    }
+    for (i = 0; i < configs->len; i++)
+        report(g_ptr_array_index(configs, i), json);
+
+    g_ptr_array_free(configs, TRUE);
+    g_ptr_array_foreach(files, (GFunc)G_CALLBACK(preload_map_free), NULL);
+    g_ptr_array_free(files, TRUE);
+    preload_state_free();
+    return EXIT_SUCCESS;
+}
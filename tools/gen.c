@@ -0,0 +1,461 @@
+/* gen.c - generate synthetic states and traces, for scaling tests
+ *
+ * This file is part of preload.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+/* Builds a synthetic model of any size and writes it as a state file the
+ * daemon, preload-sim and preload-bench load as is.  Optionally also
+ * writes a fake procfs tree, for preload --procroot, with processes of
+ * the exes of the model, and a trace of process activity over them, in
+ * the format preload --tracefile records, for preload-sim to replay:
+ *
+ *   random  exes launch independently, popular ones more often;
+ *   groups  exes launch in groups, the first of a group spawning the
+ *           others right away;
+ *   daily   groups, each of them busy for ten hours of the day and mostly
+ *           idle otherwise.
+ *
+ * Processes run for an exponentially distributed time. */
+
+#include <getopt.h>
+#include <glib/gstdio.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "conf.h"
+#include "log.h"
+#include "state.h"
+#include "synth.h"
+#include "trace.h"
+
+/* the wall clock of the start of traces, a Monday midnight UTC */
+#define GEN_WALLCLOCK 1700438400
+
+enum { PATTERN_RANDOM, PATTERN_GROUPS, PATTERN_DAILY };
+static const char* patterns[] = {"random", "groups", "daily"};
+
+static int pattern = PATTERN_RANDOM;
+static int duration = 24 * hours;
+static int cycle = 20;
+static double launches = 60; /* per hour, all exes together */
+static int runtime = 15 * minutes; /* mean */
+static int group_size = 4;
+
+typedef struct _gen_exe_t {
+    preload_exe_t* exe;
+    double rate;  /* launches per second, of it or its group */
+    pid_t pid;    /* running, or 0 */
+    int end;      /* time it exits */
+    double start; /* time it started, since boot */
+} gen_exe_t;
+
+static gen_exe_t* gexes;
+static int gexe_count;
+static pid_t last_pid = 1000;
+
+static void trace_exemap(preload_exemap_t* exemap) {
+    preload_map_t* map = exemap->map;
+    preload_trace_map(map->path, map->offset, map->length);
+}
+
+static void trace_maps(gen_exe_t* g, gboolean usage) {
+    preload_trace_maps_begin(g->pid, usage);
+    g_set_foreach(g->exe->exemaps, (GFunc)G_CALLBACK(trace_exemap), NULL);
+    preload_trace_maps_end();
+}
+
+/* new processes are written along with the scan they show up in */
+static GSList* started;
+
+static void launch(gen_exe_t* g, int time, double start, GRand* rand) {
+    if (g->pid)
+        return;
+
+    g->pid = ++last_pid;
+    g->start = start;
+    g->end = time + (int)(-log(1 - g_rand_double(rand)) * runtime) + 1;
+    started = g_slist_append(started, g);
+}
+
+static gboolean group_is_busy(int group, int elapsed) {
+    int hour = (elapsed / hours + 5 * group) % 24;
+    return hour < 10;
+}
+
+static void trace_scan(int time, int elapsed, GRand* rand) {
+    double p_scale = cycle;
+    /* traces do not record MemAvailable, so it is not set */
+    preload_memory_t mem = {.total = 8 << 20,
+                            .free_ = 2 << 20,
+                            .buffers = 256 << 10,
+                            .cached = 4 << 20};
+    int i;
+    GSList* l;
+
+    for (i = 0; i < gexe_count; i++)
+        if (gexes[i].pid && gexes[i].end <= time)
+            gexes[i].pid = 0;
+
+    for (i = 0; i < gexe_count; i++) {
+        gen_exe_t* g = &gexes[i];
+        double rate = g->rate;
+        int group = i / group_size;
+
+        if (pattern != PATTERN_RANDOM && i % group_size)
+            continue; /* spawned by the first of the group */
+        if (pattern == PATTERN_DAILY && !group_is_busy(group, elapsed))
+            rate /= 10;
+        if (g_rand_double(rand) >= 1 - exp(-rate * p_scale))
+            continue;
+
+        launch(g, time, elapsed, rand);
+        if (pattern != PATTERN_RANDOM) {
+            int j;
+            for (j = i + 1; j < gexe_count && j / group_size == group; j++)
+                launch(&gexes[j], time, elapsed + g_rand_int_range(rand, 0, 3),
+                       rand);
+        }
+    }
+
+    preload_trace_scan(time, GEN_WALLCLOCK + elapsed);
+    if (!elapsed)
+        preload_trace_memstat(&mem);
+
+    for (i = 0; i < gexe_count; i++)
+        if (gexes[i].pid)
+            preload_trace_proc(gexes[i].pid, gexes[i].exe->path);
+
+    for (l = started; l; l = l->next) {
+        gen_exe_t* g = l->data;
+        gen_exe_t* leader = &gexes[(g - gexes) / group_size * group_size];
+        pid_t ppid = 1;
+
+        if (pattern != PATTERN_RANDOM && leader != g && leader->pid)
+            ppid = leader->pid;
+        preload_trace_stat(g->pid, ppid, g->start);
+        if (ppid != 1)
+            preload_trace_stat(ppid, 1, leader->start);
+        trace_maps(g, FALSE);
+        trace_maps(g, TRUE);
+    }
+    g_slist_free(started);
+    started = NULL;
+}
+
+static void write_trace(const char* tracefile, guint32 seed) {
+    GRand* rand = g_rand_new_with_seed(seed);
+    double total = 0;
+    int i, elapsed;
+
+    gexe_count = g_hash_table_size(state->exes);
+    gexes = g_new0(gen_exe_t, gexe_count);
+
+    /* lower numbered exes are more popular */
+    for (i = 0; i < gexe_count; i++) {
+        char path[64];
+
+        g_snprintf(path, sizeof(path), SYNTH_EXE_PATH, i);
+        gexes[i].exe = g_hash_table_lookup(state->exes, path);
+        gexes[i].rate = 1. / (i + 1);
+        total += gexes[i].rate;
+    }
+    for (i = 0; i < gexe_count; i++)
+        gexes[i].rate *= launches / hours / total;
+
+    if (!preload_trace_open(tracefile))
+        exit(EXIT_FAILURE);
+
+    for (elapsed = 0; elapsed < duration; elapsed += cycle)
+        trace_scan(state->time + elapsed, elapsed, rand);
+
+    preload_trace_close();
+    g_free(gexes);
+    g_rand_free(rand);
+}
+
+/* procfs */
+
+#define CLK_TCK 100
+
+static void write_file(const char* dir, const char* file, GString* contents) {
+    char* path = g_build_filename(dir, file, NULL);
+    GError* err = NULL;
+
+    if (!g_file_set_contents(path, contents->str, contents->len, &err)) {
+        fprintf(stderr, "%s\n", err->message);
+        exit(EXIT_FAILURE);
+    }
+    g_free(path);
+    g_string_truncate(contents, 0);
+}
+
+typedef struct _procfs_maps_t {
+    GString* maps;
+    GString* smaps;
+    unsigned long addr;
+    GRand* rand;
+} procfs_maps_t;
+
+static void procfs_map_line(procfs_maps_t* ctx,
+                            const char* perms,
+                            unsigned long length,
+                            unsigned long offset,
+                            const char* path,
+                            gboolean used) {
+    char line[FILELEN + 100];
+    gboolean file = path && *path == '/';
+    unsigned long inode = file ? g_str_hash(path) : 0;
+
+    g_snprintf(line, sizeof(line), "%012lx-%012lx %s %08lx %s %-26lu%s\n",
+               ctx->addr, ctx->addr + length, perms, offset,
+               file ? "08:01" : "00:00", inode, path ? path : "");
+    g_string_append(ctx->maps, line);
+    g_string_append(ctx->smaps, line);
+    g_string_append_printf(ctx->smaps,
+                           "Size:           %8lu kB\n"
+                           "Rss:            %8lu kB\n"
+                           "Pss:            %8lu kB\n"
+                           "Swap:           %8lu kB\n",
+                           length / 1024, used ? length / 1024 : 0,
+                           used ? length / 2048 : 0, 0UL);
+    ctx->addr += length + 4096;
+}
+
+static void procfs_exemap(preload_exemap_t* exemap, procfs_maps_t* ctx) {
+    preload_map_t* map = exemap->map;
+    unsigned long length = (map->length + 4095) & ~4095UL;
+
+    procfs_map_line(ctx, "r-xp", length, map->offset, map->path,
+                    g_rand_int_range(ctx->rand, 0, 100) < 70);
+    /* and its data */
+    procfs_map_line(ctx, "rw-p", 4096, map->offset + length, map->path, TRUE);
+}
+
+/* writes dir/PID/{exe,maps,smaps,stat} for pids processes of the exes of
+ * the model, popular ones more often, some spawned by others, along with
+ * the system wide files */
+static void write_procfs(const char* dir, int pids, guint32 seed) {
+    GRand* rand = g_rand_new_with_seed(seed);
+    GString* contents = g_string_new(NULL);
+    int exe_count = g_hash_table_size(state->exes);
+    int i;
+
+    if (0 > g_mkdir_with_parents(dir, 0755)) {
+        fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < pids; i++) {
+        pid_t pid = 1000 + i, ppid = 1;
+        char path[64], *piddir, *exelink, *comm;
+        preload_exe_t* exe;
+        procfs_maps_t ctx;
+
+        g_snprintf(path, sizeof(path), SYNTH_EXE_PATH,
+                   (int)(exe_count * pow(g_rand_double(rand), 2)));
+        exe = g_hash_table_lookup(state->exes, path);
+        if (i && g_rand_int_range(rand, 0, 100) < 30)
+            ppid = 1000 + g_rand_int_range(rand, 0, i);
+
+        g_snprintf(path, sizeof(path), "%d", pid);
+        piddir = g_build_filename(dir, path, NULL);
+        g_mkdir_with_parents(piddir, 0755);
+
+        exelink = g_build_filename(piddir, "exe", NULL);
+        g_unlink(exelink);
+        if (0 > symlink(exe->path, exelink)) {
+            fprintf(stderr, "%s: %s\n", exelink, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        g_free(exelink);
+
+        ctx.maps = g_string_new(NULL);
+        ctx.smaps = g_string_new(NULL);
+        ctx.addr = 0x55d4a0000000UL;
+        ctx.rand = rand;
+        procfs_map_line(&ctx, "rw-p", 132 << 10, 0, "[heap]", TRUE);
+        ctx.addr = 0x7f3c20000000UL;
+        g_set_foreach(exe->exemaps, (GFunc)G_CALLBACK(procfs_exemap), &ctx);
+        procfs_map_line(&ctx, "rw-p", 1 << 20, 0, NULL, TRUE);
+        ctx.addr = 0x7ffc8a000000UL;
+        procfs_map_line(&ctx, "rw-p", 132 << 10, 0, "[stack]", TRUE);
+        procfs_map_line(&ctx, "r-xp", 8 << 10, 0, "[vdso]", TRUE);
+        write_file(piddir, "maps", ctx.maps);
+        write_file(piddir, "smaps", ctx.smaps);
+        g_string_free(ctx.maps, TRUE);
+        g_string_free(ctx.smaps, TRUE);
+
+        comm = g_path_get_basename(exe->path);
+        g_string_append_printf(
+            contents,
+            "%d (%.15s) S %d %d %d 0 -1 4194304 100 0 0 0 10 5 0 0 20 0 1 0 "
+            "%d 104857600 1000 18446744073709551615\n",
+            pid, comm, ppid, pid, pid, (100 + i) * CLK_TCK);
+        write_file(piddir, "stat", contents);
+        g_free(comm);
+        g_free(piddir);
+    }
+
+    g_string_append(contents,
+                    "MemTotal:        8388608 kB\n"
+                    "MemFree:         2097152 kB\n"
+                    "MemAvailable:    6291456 kB\n"
+                    "Buffers:          262144 kB\n"
+                    "Cached:          4194304 kB\n");
+    write_file(dir, "meminfo", contents);
+    g_string_append(contents, "pgpgin 1048576\npgpgout 524288\n");
+    write_file(dir, "vmstat", contents);
+    g_string_append(contents, "cpu  100 0 100 10000 0 0 0 0 0 0\n");
+    write_file(dir, "stat", contents);
+
+    g_string_free(contents, TRUE);
+    g_rand_free(rand);
+}
+
+static void count_markov(preload_markov_t G_GNUC_UNUSED* markov, int* count) {
+    (*count)++;
+}
+
+static void usage(const char* prog) {
+    fprintf(
+        stderr,
+        "Usage: %s [options]\n"
+        "Model:\n"
+        "  -e exes       number of exes\n"
+        "  -l libs       number of shared libraries\n"
+        "  -m maps       libraries mapped by each exe\n"
+        "  -o overlap    percent of those that are shared\n"
+        "  -d density    percent of exe pairs with a Markov chain\n"
+        "  -r running    percent of exes running\n"
+        "  -S seed\n"
+        "  -s statefile  where to write the model\n"
+        "Procfs:\n"
+        "  -P dir        where to write a fake procfs\n"
+        "  -n pids       number of processes in it\n"
+        "Trace:\n"
+        "  -t tracefile  where to write the trace\n"
+        "  -p pattern    random, groups or daily\n"
+        "  -D duration   in seconds\n"
+        "  -c cycle      seconds between scans\n"
+        "  -L launches   per hour\n"
+        "  -R runtime    mean, in seconds\n"
+        "  -g size       of groups\n",
+        prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+    synth_params_t params = SYNTH_PARAMS_DEFAULT;
+    const char* statefile = NULL;
+    const char* tracefile = NULL;
+    const char* procdir = NULL;
+    int pids = 1000;
+    int markovs = 0;
+    guint i;
+
+    for (;;) {
+        int c = getopt(argc, argv, "e:l:m:o:d:r:S:s:P:n:t:p:D:c:L:R:g:");
+        if (c == -1)
+            break;
+        switch (c) {
+            case 'e':
+                params.exes = strtol(optarg, NULL, 10);
+                break;
+            case 'l':
+                params.libs = strtol(optarg, NULL, 10);
+                break;
+            case 'm':
+                params.maps_per_exe = strtol(optarg, NULL, 10);
+                break;
+            case 'o':
+                params.overlap = strtol(optarg, NULL, 10);
+                break;
+            case 'd':
+                params.density = g_ascii_strtod(optarg, NULL);
+                break;
+            case 'r':
+                params.running = strtol(optarg, NULL, 10);
+                break;
+            case 'S':
+                params.seed = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                statefile = optarg;
+                break;
+            case 'P':
+                procdir = optarg;
+                break;
+            case 'n':
+                pids = strtol(optarg, NULL, 10);
+                break;
+            case 't':
+                tracefile = optarg;
+                break;
+            case 'p':
+                pattern = -1;
+                for (i = 0; i < G_N_ELEMENTS(patterns); i++)
+                    if (!strcmp(optarg, patterns[i]))
+                        pattern = i;
+                break;
+            case 'D':
+                duration = strtol(optarg, NULL, 10);
+                break;
+            case 'c':
+                cycle = strtol(optarg, NULL, 10);
+                break;
+            case 'L':
+                launches = g_ascii_strtod(optarg, NULL);
+                break;
+            case 'R':
+                runtime = strtol(optarg, NULL, 10);
+                break;
+            case 'g':
+                group_size = strtol(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc || (!statefile && !procdir && !tracefile) ||
+        params.exes <= 0 || params.libs < 0 || params.density < 0 ||
+        pattern < 0 || cycle <= 0 || runtime <= 0 || group_size <= 0 ||
+        pids <= 0)
+        usage(argv[0]);
+
+    /* warnings and worse only */
+    preload_log_level = 2;
+    preload_log_init(NULL);
+    preload_conf_load(NULL, TRUE);
+
+    preload_state_load(NULL);
+    synth_model(&params);
+    preload_state_save(statefile);
+    preload_markov_foreach((GFunc)G_CALLBACK(count_markov), &markovs);
+    fprintf(stderr, "%d exes, %d maps, %d markovs\n",
+            g_hash_table_size(state->exes), g_hash_table_size(state->maps),
+            markovs);
+
+    if (procdir)
+        write_procfs(procdir, pids, params.seed);
+    if (tracefile)
+        write_trace(tracefile, params.seed);
+
+    preload_state_free();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,172 @@
+/* select-sim.c - compare readahead budget selection policies
+ *
+ * This file is part of preload.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+/* Builds a synthetic model of exes sharing a pool of libraries, lets the
+ * exes bid in their maps the same way the prophet does, and then fills a
+ * range of memory budgets with every selection strategy, reporting the
+ * expected number of bytes that will actually be used. */
+
+#include <getopt.h>
+#include <math.h>
+
+#include "common.h"
+#include "conf.h"
+#include "prophet.h"
+#include "state.h"
+#include "synth.h"
+
+#define kb(v) ((int)(((v) + 1023) / 1024))
+
+static int num_exes = 200;
+static int num_libs = 2000;
+static int maps_per_exe = 30;
+static guint32 seed = 1;
+
+static const int budgets[] = {1, 5, 10, 25, 50}; /* percent */
+static const char* strategies[] = {"greedy", "knapsack"};
+
+static int map_prob_compare(const preload_map_t** pa,
+                            const preload_map_t** pb) {
+    const preload_map_t *a = *pa, *b = *pb;
+    return a->lnprob < b->lnprob ? -1 : a->lnprob > b->lnprob ? 1 : 0;
+}
+
+static GPtrArray* build_model(GRand* rand) {
+    GPtrArray* libs;
+    GHashTable* seen;
+    int i, j;
+
+    libs = g_ptr_array_new();
+    for (i = 0; i < num_libs; i++) {
+        char path[64];
+        preload_map_t* map;
+
+        g_snprintf(path, sizeof(path), "/usr/lib/sim/lib%d.so", i);
+        map = preload_map_new(path, 0, synth_random_size(rand));
+        map->lnprob = 0;
+        g_ptr_array_add(libs, map);
+    }
+
+    /* every exe bids in its maps with its own probability of running;
+     * lower numbered libs are more popular, hence more shared. */
+    seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (i = 0; i < num_exes; i++) {
+        double p_runs = pow(g_rand_double(rand), 3);
+
+        g_hash_table_remove_all(seen);
+        for (j = 0; j < maps_per_exe; j++) {
+            int lib = (int)(num_libs * pow(g_rand_double(rand), 2));
+            preload_map_t* map = g_ptr_array_index(libs, lib);
+
+            if (g_hash_table_lookup(seen, map))
+                continue;
+            g_hash_table_insert(seen, map, map);
+            map->lnprob += log(1 - p_runs);
+        }
+    }
+    g_hash_table_destroy(seen);
+
+    g_ptr_array_sort(libs, (GCompareFunc)map_prob_compare);
+    return libs;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [-e exes] [-l libs] [-m maps-per-exe] [-s seed]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+    GPtrArray* maps_arr;
+    GRand* rand;
+    long candidates_kb = 0;
+    int i, b, s;
+
+    for (;;) {
+        int c = getopt(argc, argv, "e:l:m:s:");
+        if (c == -1)
+            break;
+        switch (c) {
+            case 'e':
+                num_exes = strtol(optarg, NULL, 10);
+                break;
+            case 'l':
+                num_libs = strtol(optarg, NULL, 10);
+                break;
+            case 'm':
+                maps_per_exe = strtol(optarg, NULL, 10);
+                break;
+            case 's':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (num_exes <= 0 || num_libs <= 0 || maps_per_exe <= 0)
+        usage(argv[0]);
+
+    rand = g_rand_new_with_seed(seed);
+    maps_arr = build_model(rand);
+
+    for (i = 0; i < (int)(maps_arr->len); i++) {
+        preload_map_t* map = g_ptr_array_index(maps_arr, i);
+        if (map->lnprob < 0)
+            candidates_kb += kb(map->length);
+    }
+
+    printf("# exes=%d libs=%d maps-per-exe=%d seed=%u candidates=%ldkb\n",
+           num_exes, num_libs, maps_per_exe, seed, candidates_kb);
+    printf("%-8s %-10s %8s %10s %14s %8s\n", "budget%", "strategy", "maps",
+           "usedkb", "expectedhitkb", "gain%");
+
+    for (b = 0; b < (int)G_N_ELEMENTS(budgets); b++) {
+        int memavail = candidates_kb * budgets[b] / 100;
+        double baseline = 0;
+
+        for (s = 0; s < (int)G_N_ELEMENTS(strategies); s++) {
+            GPtrArray* selected = g_ptr_array_new();
+            int left;
+            double hit;
+            char gain[16] = "-";
+
+            conf->model.selectstrategy = s;
+            left = preload_prophet_select(maps_arr, memavail, selected);
+            hit = preload_prophet_expected_hit(selected);
+            if (s == SELECT_GREEDY)
+                baseline = hit;
+
+            if (baseline > 0)
+                g_snprintf(gain, sizeof(gain), "%.1lf",
+                           100 * (hit - baseline) / baseline);
+
+            printf("%-8d %-10s %8u %10d %14.0lf %8s\n", budgets[b],
+                   strategies[s], selected->len, memavail - left, hit / 1024,
+                   gain);
+            g_ptr_array_free(selected, TRUE);
+        }
+    }
+
+    g_ptr_array_foreach(maps_arr, (GFunc)G_CALLBACK(preload_map_free), NULL);
+    g_ptr_array_free(maps_arr, TRUE);
+    g_rand_free(rand);
+    return EXIT_SUCCESS;
+}
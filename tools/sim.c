@@ -0,0 +1,239 @@
+/* sim.c - replay a scan trace through the model, offline
+ *
+ * This file is part of preload.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+/* Replays a trace recorded with preload --tracefile through the spy and
+ * the prophet, on a virtual clock, with the configuration given.  Nothing
+ * is read from the disk; instead a simulated page cache keeps the maps
+ * prefetched, and those faulted in by launched exes, for a while.  Every
+ * launch of a known exe is then checked against it: a launch is a hit if
+ * none of the maps it uses has to come from the disk. */
+
+#include <getopt.h>
+
+#include "common.h"
+#include "conf.h"
+#include "log.h"
+#include "prophet.h"
+#include "spy.h"
+#include "state.h"
+#include "trace.h"
+
+#define kb(v) ((v) / 1024)
+
+typedef struct _sim_page_t {
+    int time;            /* when it got into the cache */
+    gboolean prefetched; /* by us, and not used since */
+} sim_page_t;
+
+static int window = 5 * minutes; /* how long the cache keeps a map */
+static GHashTable* cache;        /* preload_map_t -> sim_page_t */
+
+static struct {
+    int scans;
+    int launches;
+    int hits;
+    double needed;     /* bytes launched exes used */
+    double cold;       /* of those, bytes read from the disk */
+    double prefetched; /* bytes we read in */
+    double useful;     /* of those, bytes a launch used later */
+} stats;
+
+static gboolean sim_is_cached(const preload_map_t* map) {
+    sim_page_t* page = g_hash_table_lookup(cache, map);
+    return page && state->time - page->time <= window;
+}
+
+static void cache_add(const preload_map_t* map, gboolean prefetched) {
+    sim_page_t* page = g_hash_table_lookup(cache, map);
+
+    if (!page) {
+        page = g_new(sim_page_t, 1);
+        g_hash_table_insert(cache, (gpointer)map, page);
+    }
+    page->time = state->time;
+    page->prefetched = prefetched;
+}
+
+static void sim_readahead(preload_map_t** files, int file_count) {
+    int i;
+
+    for (i = 0; i < file_count; i++) {
+        if (sim_is_cached(files[i]))
+            continue;
+        stats.prefetched += files[i]->length;
+        cache_add(files[i], TRUE);
+    }
+}
+
+static const preload_trace_hooks_t hooks = {
+    .readahead = sim_readahead,
+    .is_cached = sim_is_cached,
+};
+
+typedef struct _launch_t {
+    double needed;
+    double cold;
+} launch_t;
+
+static void exemap_launch(preload_exemap_t* exemap, launch_t* launch) {
+    preload_map_t* map = exemap->map;
+    sim_page_t* page;
+
+    if (conf->model.usemapprob && exemap->prob <= 0)
+        return;
+
+    launch->needed += map->length;
+    page = g_hash_table_lookup(cache, map);
+    if (!sim_is_cached(map))
+        launch->cold += map->length;
+    else if (page->prefetched)
+        stats.useful += map->length;
+
+    /* the process faults it in anyway */
+    cache_add(map, FALSE);
+}
+
+static void exe_launch(preload_exe_t* exe) {
+    launch_t launch = {0, 0};
+
+    g_set_foreach(exe->exemaps, (GFunc)G_CALLBACK(exemap_launch), &launch);
+
+    stats.launches++;
+    if (!launch.cold)
+        stats.hits++;
+    stats.needed += launch.needed;
+    stats.cold += launch.cold;
+}
+
+/* the daemon's own account of its readaheads, see prophet.c */
+static struct {
+    int prefetched;
+    int hits;
+    int evicted;
+    int wasted;
+} mapuse;
+
+static void map_sum_use(preload_map_t* map) {
+    mapuse.prefetched += map->prefetched;
+    mapuse.hits += map->hits;
+    mapuse.evicted += map->evicted;
+    mapuse.wasted += map->wasted;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [-c conffile] [-s statefile] [-w window] tracefile\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+    const char* conffile = NULL;
+    const char* statefile = NULL;
+    int rec_time, base, start;
+    GTimer* timer;
+    double elapsed;
+
+    for (;;) {
+        int c = getopt(argc, argv, "c:s:w:");
+        if (c == -1)
+            break;
+        switch (c) {
+            case 'c':
+                conffile = optarg;
+                break;
+            case 's':
+                statefile = optarg;
+                break;
+            case 'w':
+                window = strtol(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || window <= 0)
+        usage(argv[0]);
+
+    /* warnings and worse only */
+    preload_log_level = 2;
+    preload_log_init(NULL);
+    preload_conf_load(conffile, TRUE);
+
+    if (!preload_trace_replay_open(argv[optind], &hooks))
+        return EXIT_FAILURE;
+    if (!preload_trace_replay_step(&rec_time)) {
+        fprintf(stderr, "%s: empty trace\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    cache = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    preload_state_load(statefile);
+    start = state->time;
+    base = start - rec_time;
+
+    /* the same steps as preload_state_tick and preload_state_tick2, on
+     * the clock of the trace */
+    timer = g_timer_new();
+    do {
+        state->time = base + rec_time;
+        stats.scans++;
+
+        if (conf->system.doscan) {
+            preload_spy_scan(NULL);
+            g_slist_foreach(state->launched_exes,
+                            (GFunc)G_CALLBACK(exe_launch), NULL);
+        }
+        if (conf->system.dopredict)
+            preload_prophet_predict(NULL);
+
+        state->time += conf->model.cycle / 2;
+        if (conf->system.doscan)
+            preload_spy_update_model(NULL);
+    } while (preload_trace_replay_step(&rec_time));
+    elapsed = g_timer_elapsed(timer, NULL);
+
+    printf("# trace=%s scans=%d simulated=%ds elapsed=%.2lfs window=%ds\n",
+           argv[optind], stats.scans, state->time - start, elapsed, window);
+    printf("%-14s %12d\n", "launches", stats.launches);
+    printf("%-14s %12d %7.1lf%%\n", "hits", stats.hits,
+           stats.launches ? 100. * stats.hits / stats.launches : 0);
+    printf("%-14s %12.0lf\n", "neededkb", kb(stats.needed));
+    printf("%-14s %12.0lf %7.1lf%%\n", "coldkb", kb(stats.cold),
+           stats.needed ? 100 * stats.cold / stats.needed : 0);
+    printf("%-14s %12.0lf\n", "prefetchedkb", kb(stats.prefetched));
+    printf("%-14s %12.0lf %7.1lf%%\n", "usefulkb", kb(stats.useful),
+           stats.prefetched ? 100 * stats.useful / stats.prefetched : 0);
+
+    g_ptr_array_foreach(state->maps_arr, (GFunc)G_CALLBACK(map_sum_use), NULL);
+    printf("%-14s %12d\n", "mapprefetches", mapuse.prefetched);
+    printf("%-14s %12d %7.1lf%%\n", "maphits", mapuse.hits,
+           mapuse.prefetched ? 100. * mapuse.hits / mapuse.prefetched : 0);
+    printf("%-14s %12d %7.1lf%%\n", "mapevicted", mapuse.evicted,
+           mapuse.prefetched ? 100. * mapuse.evicted / mapuse.prefetched : 0);
+    printf("%-14s %12d %7.1lf%%\n", "mapwasted", mapuse.wasted,
+           mapuse.prefetched ? 100. * mapuse.wasted / mapuse.prefetched : 0);
+
+    g_timer_destroy(timer);
+    g_hash_table_destroy(cache);
+    preload_trace_replay_close();
+    preload_state_free();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,183 @@
+/* synth.c - synthetic preload models
+ *
+ * This file is part of preload.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "synth.h"
+
+#include <math.h>
+
+#include "common.h"
+#include "conf.h"
+
+/* how long the synthetic model has been watching, in seconds */
+#define SYNTH_TIME (30 * 24 * hours)
+
+size_t synth_random_size(GRand* rand) {
+    double r = g_rand_double(rand);
+    double lo, hi;
+
+    if (r < 0.80) {
+        lo = 4 << 10;
+        hi = 512 << 10;
+    } else if (r < 0.95) {
+        lo = 512 << 10;
+        hi = 8 << 20;
+    } else {
+        lo = 8 << 20;
+        hi = 256 << 20;
+    }
+
+    /* log-uniform in [lo, hi) */
+    return (size_t)exp(g_rand_double_range(rand, log(lo), log(hi)));
+}
+
+/* a history consistent with the running times of both exes: they ran
+ * together for somewhere between the least and the most possible. */
+static void markov_randomize(preload_markov_t* markov, GRand* rand) {
+    int a = markov->a->time, b = markov->b->time, t = state->time;
+    int i, j;
+
+    markov->time = g_rand_int_range(rand, MAX(0, a + b - t), MIN(a, b) + 1);
+    markov->change_timestamp =
+        MAX(markov->a->change_timestamp, markov->b->change_timestamp);
+
+    for (i = 0; i < 4; i++) {
+        markov->weight[i][i] = 0;
+        for (j = 0; j < 4; j++) {
+            if (i == j)
+                continue;
+            markov->weight[i][j] = g_rand_int_range(rand, 0, 20);
+            markov->weight[i][i] += markov->weight[i][j];
+        }
+        markov->time_to_leave[i] = g_rand_double_range(rand, 10, 10000);
+    }
+}
+
+/* chains with density percent of the count exes before exe, as the
+ * daemon would have created had they all been running together. */
+static void add_markovs(preload_exe_t* exe,
+                        GPtrArray* exes,
+                        double density,
+                        GRand* rand) {
+    double p = density / 100;
+    int count = exes->len, want, i;
+    GHashTable* partners;
+
+    /* dense enough to just walk them all */
+    if (p >= 0.25) {
+        for (i = 0; i < count; i++)
+            if (g_rand_double(rand) < p)
+                preload_markov_new(exe, g_ptr_array_index(exes, i), TRUE);
+        return;
+    }
+
+    want = (int)(p * count + g_rand_double(rand));
+    partners = g_hash_table_new(g_direct_hash, g_direct_equal);
+    while ((int)g_hash_table_size(partners) < want) {
+        preload_exe_t* other =
+            g_ptr_array_index(exes, g_rand_int_range(rand, 0, count));
+
+        if (g_hash_table_lookup(partners, other))
+            continue;
+        g_hash_table_insert(partners, other, other);
+        preload_markov_new(exe, other, TRUE);
+    }
+    g_hash_table_destroy(partners);
+}
+
+void synth_model(const synth_params_t* params) {
+    GPtrArray *libs, *exes;
+    GHashTable* mapped;
+    GRand* rand;
+    int i, j;
+
+    rand = g_rand_new_with_seed(params->seed);
+
+    state->time = SYNTH_TIME;
+    state->last_running_timestamp = state->time;
+    state->last_accounting_timestamp = state->time;
+
+    mapped = g_hash_table_new(g_direct_hash, g_direct_equal);
+    libs = g_ptr_array_new();
+    for (i = 0; i < params->libs; i++) {
+        char path[64];
+
+        g_snprintf(path, sizeof(path), "/usr/lib/synth/lib%d.so", i);
+        g_ptr_array_add(libs,
+                        preload_map_new(path, 0, synth_random_size(rand)));
+    }
+
+    exes = g_ptr_array_new();
+    for (i = 0; i < params->exes; i++) {
+        char path[64];
+        preload_exe_t* exe;
+        gboolean running;
+
+        running = g_rand_int_range(rand, 0, 100) < params->running;
+        g_snprintf(path, sizeof(path), SYNTH_EXE_PATH, i);
+        exe = preload_exe_new(path, running, NULL);
+        exe->time = g_rand_int_range(rand, 1, state->time);
+
+        preload_exe_map_new(exe,
+                            preload_map_new(path, 0, synth_random_size(rand)));
+
+        g_hash_table_remove_all(mapped);
+        for (j = 0; j < params->maps_per_exe; j++) {
+            preload_map_t* map;
+
+            if (params->libs &&
+                g_rand_int_range(rand, 0, 100) < params->overlap) {
+                /* lower numbered libs are more popular, hence more shared */
+                int lib = (int)(params->libs * pow(g_rand_double(rand), 2));
+                map = g_ptr_array_index(libs, lib);
+                if (g_hash_table_lookup(mapped, map))
+                    continue;
+                g_hash_table_insert(mapped, map, map);
+            } else {
+                g_snprintf(path, sizeof(path), "/usr/lib/synth%d/lib%d.so", i,
+                           j);
+                map = preload_map_new(path, 0, synth_random_size(rand));
+            }
+            preload_exe_map_new(exe, map);
+        }
+
+        preload_state_register_exe(exe, params->density >= 100);
+        if (params->density < 100)
+            add_markovs(exe, exes, params->density, rand);
+        exe->change_timestamp = g_rand_int_range(rand, 1, state->time);
+        if (running)
+            state->running_exes = g_slist_prepend(state->running_exes, exe);
+        g_ptr_array_add(exes, exe);
+    }
+
+    preload_markov_foreach((GFunc)G_CALLBACK(markov_randomize), rand);
+
+    /* libs no exe picked were never referenced */
+    for (i = 0; i < params->libs; i++) {
+        preload_map_t* map = g_ptr_array_index(libs, i);
+        if (!map->refcount)
+            preload_map_free(map);
+    }
+
+    g_hash_table_destroy(mapped);
+    g_ptr_array_free(exes, TRUE);
+    g_ptr_array_free(libs, TRUE);
+    g_rand_free(rand);
+    state->dirty = TRUE;
+}
@@ -0,0 +1,31 @@
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <state.h>
+
+/* synth_params_t: shape of a synthetic model. */
+typedef struct _synth_params_t {
+    int exes;         /* number of exes. */
+    int libs;         /* number of shared libraries to pick maps from. */
+    int maps_per_exe; /* libraries mapped by each exe, besides itself. */
+    int overlap;      /* percent of those coming from the shared ones, the
+                         rest being private to the exe. */
+    double density;   /* percent of exe pairs having a Markov chain. */
+    int running;      /* percent of the exes running. */
+    guint32 seed;
+} synth_params_t;
+
+#define SYNTH_PARAMS_DEFAULT {200, 2000, 30, 80, 100, 10, 1}
+
+/* exe number i of a synthetic model is at this path */
+#define SYNTH_EXE_PATH "/usr/bin/synth%d"
+
+/* a random map size: mostly small, with a long tail of huge ones */
+size_t synth_random_size(GRand* rand);
+
+/* fills the freshly loaded state with a synthetic model: exes mapping
+ * shared libraries, popular ones more often, with a made up history of
+ * running times and Markov chains between exes. */
+void synth_model(const synth_params_t* params);
+
+#endif